@@ -31,6 +31,7 @@ private:
     int frame_size_;
     int sample_rate_;
     int duration_ms_;
+    int channels_;
 };
 
 #endif // _OPUS_DECODER_WRAPPER_H_
@@ -14,7 +14,7 @@
 
 class OpusEncoderWrapper {
 public:
-    OpusEncoderWrapper(int sample_rate, int channels, int duration_ms = 60);
+    OpusEncoderWrapper(int sample_rate, int channels, int duration_ms = 60, int application = OPUS_APPLICATION_VOIP);
     ~OpusEncoderWrapper();
 
     inline int sample_rate() const {
@@ -27,6 +27,7 @@ public:
 
     void SetDtx(bool enable);
     void SetComplexity(int complexity);
+    void SetBitrate(int bitrate);
     void Encode(std::vector<int16_t>&& pcm, std::function<void(std::vector<uint8_t>&& opus)> handler);
     bool IsBufferEmpty() const { return in_buffer_.empty(); }
     void ResetState();
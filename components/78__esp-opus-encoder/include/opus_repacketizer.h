@@ -0,0 +1,40 @@
+#ifndef _OPUS_REPACKETIZER_WRAPPER_H_
+#define _OPUS_REPACKETIZER_WRAPPER_H_
+
+#include <functional>
+#include <vector>
+#include <list>
+#include <cstdint>
+
+#include "opus.h"
+
+// Merges consecutive short Opus packets into one multi-frame packet, so short frames
+// for low encoder latency do not multiply the per-packet transport overhead.
+// A merged packet is a normal Opus packet, any decoder can decode it as a whole.
+class OpusRepacketizerWrapper {
+public:
+    OpusRepacketizerWrapper(int max_frames_per_packet = 3);
+    ~OpusRepacketizerWrapper();
+
+    inline int frames_per_packet() const {
+        return frames_per_packet_;
+    }
+
+    inline int max_frames_per_packet() const {
+        return max_frames_per_packet_;
+    }
+
+    void SetFramesPerPacket(int frames);
+    void Push(std::vector<uint8_t>&& opus, std::function<void(std::vector<uint8_t>&& opus)> handler);
+    void Flush(std::function<void(std::vector<uint8_t>&& opus)> handler);
+    void ResetState();
+
+private:
+    OpusRepacketizer* repacketizer_ = nullptr;
+    int max_frames_per_packet_;
+    int frames_per_packet_ = 1;
+    // opus_repacketizer_cat keeps pointers into the frames until the packet is emitted
+    std::list<std::vector<uint8_t>> frames_;
+};
+
+#endif // _OPUS_REPACKETIZER_WRAPPER_H_
@@ -19,8 +19,8 @@ public:
 
 private:
     silk_resampler_state_struct resampler_state_;
-    int input_sample_rate_;
-    int output_sample_rate_;
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
 };
 
 #endif
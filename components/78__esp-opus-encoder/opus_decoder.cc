@@ -4,7 +4,7 @@
 #define TAG "OpusDecoderWrapper"
 
 OpusDecoderWrapper::OpusDecoderWrapper(int sample_rate, int channels, int duration_ms)
-    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    : sample_rate_(sample_rate), duration_ms_(duration_ms), channels_(channels) {
     int error;
     audio_dec_ = opus_decoder_create(sample_rate, channels, &error);
     if (audio_dec_ == nullptr) {
@@ -29,12 +29,27 @@ bool OpusDecoderWrapper::Decode(std::vector<uint8_t>&& opus, std::vector<int16_t
         return false;
     }
 
-    pcm.resize(frame_size_);
+    // An empty packet stands for a lost one, the decoder conceals one frame from its state
+    if (opus.empty()) {
+        pcm.resize(frame_size_);
+        auto ret = opus_decode(audio_dec_, nullptr, 0, pcm.data(), frame_size_ / channels_, 0);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to conceal lost audio, error code: %d", ret);
+            return false;
+        }
+        pcm.resize(ret * channels_);
+        return true;
+    }
+
+    // A packet may carry several frames (repacketized short frames), size the output for all of them
+    int samples = opus_decoder_get_nb_samples(audio_dec_, opus.data(), opus.size()) * channels_;
+    pcm.resize(samples > frame_size_ ? samples : frame_size_);
     auto ret = opus_decode(audio_dec_, opus.data(), opus.size(), pcm.data(), pcm.size(), 0);
     if (ret < 0) {
         ESP_LOGE(TAG, "Failed to decode audio, error code: %d", ret);
         return false;
     }
+    pcm.resize(ret * channels_);
 
     return true;
 }
@@ -3,10 +3,10 @@
 
 #define TAG "OpusEncoderWrapper"
 
-OpusEncoderWrapper::OpusEncoderWrapper(int sample_rate, int channels, int duration_ms)
+OpusEncoderWrapper::OpusEncoderWrapper(int sample_rate, int channels, int duration_ms, int application)
     : sample_rate_(sample_rate), duration_ms_(duration_ms) {
     int error;
-    audio_enc_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    audio_enc_ = opus_encoder_create(sample_rate, channels, application, &error);
     if (audio_enc_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
         return;
@@ -79,3 +79,10 @@ void OpusEncoderWrapper::SetComplexity(int complexity) {
         opus_encoder_ctl(audio_enc_, OPUS_SET_COMPLEXITY(complexity));
     }
 }
+
+void OpusEncoderWrapper::SetBitrate(int bitrate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_BITRATE(bitrate));
+    }
+}
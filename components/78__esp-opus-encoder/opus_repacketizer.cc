@@ -0,0 +1,88 @@
+#include "opus_repacketizer.h"
+#include "opus_encoder.h"
+#include <esp_log.h>
+
+#define TAG "OpusRepacketizer"
+
+OpusRepacketizerWrapper::OpusRepacketizerWrapper(int max_frames_per_packet)
+    : max_frames_per_packet_(max_frames_per_packet) {
+    repacketizer_ = opus_repacketizer_create();
+    if (repacketizer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create repacketizer");
+    }
+}
+
+OpusRepacketizerWrapper::~OpusRepacketizerWrapper() {
+    if (repacketizer_ != nullptr) {
+        opus_repacketizer_destroy(repacketizer_);
+    }
+}
+
+void OpusRepacketizerWrapper::SetFramesPerPacket(int frames) {
+    if (frames < 1) {
+        frames = 1;
+    } else if (frames > max_frames_per_packet_) {
+        frames = max_frames_per_packet_;
+    }
+    frames_per_packet_ = frames;
+}
+
+void OpusRepacketizerWrapper::Push(std::vector<uint8_t>&& opus, std::function<void(std::vector<uint8_t>&& opus)> handler) {
+    if (repacketizer_ == nullptr || (frames_per_packet_ <= 1 && frames_.empty())) {
+        handler(std::move(opus));
+        return;
+    }
+
+    frames_.emplace_back(std::move(opus));
+    auto& frame = frames_.back();
+    if (opus_repacketizer_cat(repacketizer_, frame.data(), frame.size()) != OPUS_OK) {
+        // The frame does not match the TOC of the pending ones (mode or bandwidth changed), start a new packet with it
+        auto pending = std::move(frame);
+        frames_.pop_back();
+        Flush(handler);
+        frames_.emplace_back(std::move(pending));
+        auto& first = frames_.back();
+        if (opus_repacketizer_cat(repacketizer_, first.data(), first.size()) != OPUS_OK) {
+            ESP_LOGW(TAG, "Invalid opus frame, size: %u", first.size());
+            handler(std::move(first));
+            frames_.clear();
+            opus_repacketizer_init(repacketizer_);
+            return;
+        }
+    }
+
+    if ((int)frames_.size() >= frames_per_packet_) {
+        Flush(handler);
+    }
+}
+
+void OpusRepacketizerWrapper::Flush(std::function<void(std::vector<uint8_t>&& opus)> handler) {
+    if (frames_.empty()) {
+        return;
+    }
+
+    if (frames_.size() == 1) {
+        handler(std::move(frames_.front()));
+    } else {
+        uint8_t packet[MAX_OPUS_PACKET_SIZE];
+        auto ret = opus_repacketizer_out(repacketizer_, packet, sizeof(packet));
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to merge %u frames, error code: %ld", frames_.size(), ret);
+            // Fall back to sending the frames one by one
+            for (auto& frame : frames_) {
+                handler(std::move(frame));
+            }
+        } else {
+            handler(std::vector<uint8_t>(packet, packet + ret));
+        }
+    }
+    frames_.clear();
+    opus_repacketizer_init(repacketizer_);
+}
+
+void OpusRepacketizerWrapper::ResetState() {
+    frames_.clear();
+    if (repacketizer_ != nullptr) {
+        opus_repacketizer_init(repacketizer_);
+    }
+}
@@ -7,6 +7,9 @@
 #include "websocket_protocol.h"
 #include "assets/lang_config.h"
 #include "nfc/nfc_task.h"
+#if CONFIG_USE_OPUS_BENCHMARK
+#include "opus_benchmark.h"
+#endif
 #include <nvs_flash.h>
 #include <esp_system.h>
 
@@ -14,7 +17,6 @@
 
 #include <cstring>
 #include <esp_log.h>
-#include <cJSON.h>
 #include <driver/gpio.h>
 #include <arpa/inet.h>
 #include <esp_app_desc.h>
@@ -59,6 +61,36 @@ Application::Application() {
         .skip_unhandled_events = true
     };
     esp_timer_create(&clock_timer_args, &clock_timer_handle_);
+
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    esp_timer_create_args_t response_timer_args = {
+        .callback = [](void* arg) {
+            Application* app = (Application*)arg;
+            app->Schedule([app]() {
+                app->OnResponseTimeout();
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "response_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&response_timer_args, &response_timer_handle_);
+#endif
+
+#if CONFIG_USE_SPECULATIVE_PRECONNECT
+    esp_timer_create_args_t preconnect_timer_args = {
+        .callback = [](void* arg) {
+            Application* app = (Application*)arg;
+            app->Preconnect("button held");
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "preconnect_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&preconnect_timer_args, &preconnect_timer_handle_);
+#endif
 }
 
 Application::~Application() {
@@ -66,6 +98,18 @@ Application::~Application() {
         esp_timer_stop(clock_timer_handle_);
         esp_timer_delete(clock_timer_handle_);
     }
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    if (response_timer_handle_ != nullptr) {
+        esp_timer_stop(response_timer_handle_);
+        esp_timer_delete(response_timer_handle_);
+    }
+#endif
+#if CONFIG_USE_SPECULATIVE_PRECONNECT
+    if (preconnect_timer_handle_ != nullptr) {
+        esp_timer_stop(preconnect_timer_handle_);
+        esp_timer_delete(preconnect_timer_handle_);
+    }
+#endif
     if (background_task_ != nullptr) {
         delete background_task_;
     }
@@ -118,10 +162,8 @@ void Application::CheckNewVersion() {
                 auto codec = board.GetAudioCodec();
                 codec->EnableInput(false);
                 codec->EnableOutput(false);
-                {
-                    std::lock_guard<std::mutex> lock(mutex_);
-                    audio_decode_queue_.clear();
-                }
+                tts_spool_.Clear();
+                prompt_sequencer_.Clear();
                 background_task_->WaitForCompletion();
                 delete background_task_;
                 background_task_ = nullptr;
@@ -192,29 +234,30 @@ void Application::ShowActivationCode() {
         digit_sound{'9', Lang::Sounds::P3_9}
     }};
 
-    // This sentence uses 9KB of SRAM, so we need to wait for it to finish
     // Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy", Lang::Sounds::P3_ACTIVATION);
-    vTaskDelay(pdMS_TO_TICKS(1000));
-    background_task_->WaitForCompletion();
-
+    std::vector<std::string_view> sounds;
     for (const auto& digit : code) {
         auto it = std::find_if(digit_sounds.begin(), digit_sounds.end(),
             [digit](const digit_sound& ds) { return ds.digit == digit; });
         if (it != digit_sounds.end()) {
-            PlaySound(it->sound);
+            sounds.push_back(it->sound);
         }
     }
+    // The digits are played back-to-back by the prompt sequencer, no need to wait here
+    PlayPrompts(std::move(sounds), kPromptPriorityInfo, [](bool completed) {
+        ESP_LOGI(TAG, "Activation code prompt %s", completed ? "completed" : "interrupted");
+    });
 }
 
-void Application::Alert(const char* status, const char* message, const char* emotion, const std::string_view& sound) {
+void Application::Alert(const char* status, const char* message, const char* emotion, const std::string_view& sound,
+    PromptPriority priority) {
     ESP_LOGW(TAG, "Alert %s: %s [%s]", status, message, emotion);
     // auto display = Board::GetInstance().GetDisplay();
     // display->SetStatus(status);
     // display->SetEmotion(emotion);
     // display->SetChatMessage("system", message);
     if (!sound.empty()) {
-        ResetDecoder();
-        PlaySound(sound);
+        PlayPrompts({sound}, priority);
     }
 }
 
@@ -228,29 +271,23 @@ void Application::DismissAlert() {
 }
 
 void Application::PlaySound(const std::string_view& sound) {
+    PlayPrompts({sound});
+}
+
+void Application::PlayPrompts(std::vector<std::string_view> sounds, PromptPriority priority,
+    PromptSequencer::CompletionCallback on_complete) {
     // 只有在音频编解码器可用时才播放声音
-    if (!opus_decoder_) {
+    if (!prompt_sequencer_.decoder()) {
         ESP_LOGW(TAG, "Audio decoder not available, skipping sound playback");
+        if (on_complete) {
+            on_complete(false);
+        }
         return;
     }
-    
-    // The assets are encoded at 16000Hz, 60ms frame duration
-    SetDecodeSampleRate(16000, 60);
-    const char* data = sound.data();
-    size_t size = sound.size();
-    for (const char* p = data; p < data + size; ) {
-        auto p3 = (BinaryProtocol3*)p;
-        p += sizeof(BinaryProtocol3);
-
-        auto payload_size = ntohs(p3->payload_size);
-        std::vector<uint8_t> opus;
-        opus.resize(payload_size);
-        memcpy(opus.data(), p3->payload, payload_size);
-        p += payload_size;
 
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(opus));
-    }
+    // The prompts have their own decoder, so they neither reset nor switch the TTS decoder
+    WakeOutput();
+    prompt_sequencer_.Play(std::move(sounds), priority, std::move(on_complete));
 }
 
 void Application::ToggleChatState() {
@@ -317,6 +354,7 @@ void Application::StartListening() {
 void Application::StopListening() {
     Schedule([this]() {
         if (device_state_ == kDeviceStateListening) {
+            FlushUplink();
             protocol_->SendStopListening();
             SetDeviceState(kDeviceStateIdle);
         }
@@ -327,6 +365,11 @@ void Application::Start() {
     auto& board = Board::GetInstance();
     SetDeviceState(kDeviceStateStarting);
 
+#if CONFIG_USE_OPUS_BENCHMARK
+    // Before the audio, network and application tasks exist, nothing else competes for the CPU
+    OpusBenchmark::Start();
+#endif
+
 #if Axp2101_ENABLED
     auto pmic_t = board.GetPmic();
     pmic_t->StartMonitoring();
@@ -337,8 +380,11 @@ void Application::Start() {
 
     /* Setup the audio codec */
     auto codec = board.GetAudioCodec();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    opus_decoder_ = opus_decoder_pool_.Get(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    // The assets are encoded at 16000Hz, 60ms frame duration. Opus can decode them at any
+    // supported rate, so decode directly at the codec output rate and skip the output resampler
+    prompt_sequencer_.Initialize(codec->output_sample_rate());
+    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_ENCODE_FRAME_DURATION_MS);
     if (realtime_chat_enabled_) {
         ESP_LOGI(TAG, "Realtime chat enabled, setting opus encoder complexity to 0");
         opus_encoder_->SetComplexity(0);
@@ -356,23 +402,16 @@ void Application::Start() {
     }
     
     codec->Start(); 
+    // The channel count is final only after Start, it may add a software reference channel
+    SelectCapturePipeline();
 
 #if Button_ENABLED
     static Button volume_up_button_(VOLUME_UP_BUTTON_GPIO);
     static Button volume_down_button_(VOLUME_DOWN_BUTTON_GPIO);
 
     // 音量增加按钮 - 只在音频可用时启用
-    volume_up_button_.OnClick([this, codec]() {
-        auto volume = codec->output_volume() + 5;
-        if (volume > 100) {
-            volume = 100;
-            ResetDecoder();
-            Alert("提示", "音量已达最大值", "", Lang::Sounds::P3_VOL_MAX);
-        } else {
-            ResetDecoder();
-            Alert("提示", "音量加", "", Lang::Sounds::P3_VOL_UP);
-        }
-        codec->SetOutputVolume(volume);
+    volume_up_button_.OnClick([this]() {
+        ChangeOutputVolume(5, true);
         ESP_LOGI(TAG, "Click detected, volue + 5");
     });
 
@@ -382,20 +421,22 @@ void Application::Start() {
     });
 
     // 音量减少按钮 - 只在音频可用时启用
-    volume_down_button_.OnClick([this, codec]() {
-        auto volume = codec->output_volume() - 5;
-        if (volume < 50) {
-            volume = 50;
-            ResetDecoder();
-            Alert("提示", "音量已达最小值", "", Lang::Sounds::P3_VOL_MIN);
-        } else {  
-            ResetDecoder();
-            Alert("提示", "音量减", "", Lang::Sounds::P3_VOL_DOWN);
-        }
-        codec->SetOutputVolume(volume);
+    volume_down_button_.OnClick([this]() {
+        ChangeOutputVolume(-5, true);
         ESP_LOGI(TAG, "Click detected, volue - 5");
     });
 
+    // 长按才开始对话，按住超过 CONFIG_PRECONNECT_PRESS_MS 时先建立连接，单击调音量不会触发
+#if CONFIG_USE_SPECULATIVE_PRECONNECT
+    volume_down_button_.OnPressDown([this]() {
+        esp_timer_stop(preconnect_timer_handle_);
+        esp_timer_start_once(preconnect_timer_handle_, CONFIG_PRECONNECT_PRESS_MS * 1000);
+    });
+    volume_down_button_.OnPressUp([this]() {
+        esp_timer_stop(preconnect_timer_handle_);
+    });
+#endif
+
     volume_down_button_.OnLongPress([this, codec]() {
         WakeWordInvoke("1");
     });
@@ -422,14 +463,25 @@ void Application::Start() {
     protocol_ = std::make_unique<WebsocketProtocol>();
 #else
     protocol_ = std::make_unique<MqttProtocol>();
+#endif
+#if CONFIG_USE_UPLINK_WRITER
+    uplink_writer_.OnSent([this](int64_t send_time_us, size_t backlog) {
+        AdaptUplinkPacketing(send_time_us, backlog);
+    });
+    uplink_writer_.Start([this](const AudioStreamPacket& packet) {
+        protocol_->SendAudio(packet);
+    });
 #endif
     protocol_->OnNetworkError([this](const std::string& message) {
         SetDeviceState(kDeviceStateIdle);
-        Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
+        Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION, kPromptPriorityError);
     });
-    protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(data));
+    protocol_->OnIncomingAudio([this](const uint8_t* data, size_t size) {
+        TtsFlowTransition flow = kTtsFlowNone;
+        if (!tts_spool_.Push(data, size, &flow)) {
+            ESP_LOGW(TAG, "TTS spool is full, packet dropped");
+        }
+        UpdateFlowControl(flow);
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
@@ -445,44 +497,69 @@ void Application::Start() {
             SetDeviceState(kDeviceStateIdle);
         });
     });
-    protocol_->OnIncomingJson([this](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
-                        SetDeviceState(kDeviceStateSpeaking);
-                    }
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    background_task_->WaitForCompletion();
-                    if (device_state_ == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
+    protocol_->OnIncomingJson([this](const JsonMessage& message) {
+        // Dispatch on the hashed type, the string compare only confirms the match
+        auto type = message.type();
+        switch (JsonHash(type)) {
+        case JsonHash("tts"):
+            if (type == "tts") {
+                auto state = message.GetString(0, "state");
+                if (state == "start") {
+#if CONFIG_USE_DRIFT_COMPENSATION
+                    // Also when the state does not change, e.g. a new answer while already speaking
+                    drift_compensator_.Reset();
+#endif
+                    // Marked here like the stop below, so the two apply in the order the server sent them
+                    // and the audio that follows is not taken for the tail of the previous answer
+                    tts_spool_.MarkStarted();
+                    Schedule([this]() {
+                        aborted_ = false;
+                        if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
+                            SetDeviceState(kDeviceStateSpeaking);
+                        }
+                    });
+                } else if (state == "stop") {
+                    // The whole answer is received, the state changes once the spool is played out
+                    tts_spool_.MarkComplete();
+                    Schedule([this]() {
+                        if (tts_spool_.TakeDrained()) {
+                            FinishSpeaking();
+                            return;
+                        }
+#if CONFIG_USE_TTS_EARLY_RADIO_SLEEP
+                        if (!tts_spool_.IsComplete()) {
+                            // Already played out by the audio loop, or the next answer has started
+                            return;
                         }
+                        ESP_LOGI(TAG, "TTS fully received, %u bytes left to play, radio enters power save", tts_spool_.used_bytes());
+                        Board::GetInstance().SetPowerSaveMode(true);
+#endif
+                    });
+                } else if (state == "sentence_start") {
+                    auto text = message.GetString(0, "text");
+                    if (!text.empty()) {
+                        ESP_LOGI(TAG, "<< %.*s", (int)text.size(), text.data());
                     }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (text != NULL) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
                 }
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (text != NULL) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
+            break;
+        case JsonHash("stt"):
+            if (type == "stt") {
+                auto text = message.GetString(0, "text");
+                if (!text.empty()) {
+                    ESP_LOGI(TAG, ">> %.*s", (int)text.size(), text.data());
+                }
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (emotion != NULL) {
+            break;
+        case JsonHash("llm"):
+            if (type == "llm") {
+                auto emotion = message.GetString(0, "emotion");
+                if (!emotion.empty()) {
+                }
             }
+            break;
+        default:
+            break;
         }
     });
     
@@ -490,16 +567,40 @@ void Application::Start() {
 
 #if CONFIG_USE_AUDIO_PROCESSOR
     audio_processor_.Initialize(codec, realtime_chat_enabled_);
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    endpoint_detector_.Configure(CONFIG_ENDPOINT_SILENCE_MS, CONFIG_ENDPOINT_MIN_SPEECH_MS, CONFIG_ENDPOINT_ENERGY_THRESHOLD);
+#endif
     audio_processor_.OnOutput([this](std::vector<int16_t>&& data) {
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
+#if CONFIG_USE_DEVICE_ENDPOINTING
+        if (listening_mode_ == kListeningModeAutoStop) {
+            // Stop streaming silence once the user has finished, the server no longer needs to endpoint
+            if (endpoint_detector_.triggered()) {
+                return;
+            }
+            if (endpoint_detector_.Process(data)) {
+                Schedule([this]() {
+                    if (device_state_ == kDeviceStateListening && listening_mode_ == kListeningModeAutoStop) {
+                        FlushUplink();
+                        protocol_->SendStopListening();
+                        audio_processor_.Stop();
+                        // The microphone stays off until the answer, do not wait forever if none comes
+                        esp_timer_start_once(response_timer_handle_, CONFIG_ENDPOINT_RESPONSE_TIMEOUT_MS * 1000);
+                    }
                 });
-            });
+            }
+        }
+#endif
+        // The AFE output trails the last chunk fed to it by a constant processing delay
+        int64_t capture_time_us = last_capture_end_us_ - data.size() * 1000000LL / 16000;
+        background_task_->Schedule([this, capture_time_us, data = std::move(data)]() mutable {
+            EncodeAudio(std::move(data), capture_time_us);
         });
     });
     audio_processor_.OnVadStateChange([this](bool speaking) {
+#if CONFIG_USE_DEVICE_ENDPOINTING
+        // Called from the audio processor task, the same task that feeds the endpoint detector
+        endpoint_detector_.SetVadState(speaking);
+#endif
         if (device_state_ == kDeviceStateListening) {
             Schedule([this, speaking]() {
                 if (speaking) {
@@ -512,6 +613,25 @@ void Application::Start() {
     });
 #endif
 
+#if CONFIG_USE_LOCAL_COMMANDS
+    if (command_recognizer_.Initialize(codec->input_reference())) {
+        command_recognizer_.AddCommand(kLocalCommandVolumeUp, CONFIG_LOCAL_COMMAND_VOLUME_UP);
+        command_recognizer_.AddCommand(kLocalCommandVolumeDown, CONFIG_LOCAL_COMMAND_VOLUME_DOWN);
+        command_recognizer_.AddCommand(kLocalCommandPause, CONFIG_LOCAL_COMMAND_PAUSE);
+        command_recognizer_.AddCommand(kLocalCommandStop, CONFIG_LOCAL_COMMAND_STOP);
+        command_recognizer_.UpdateCommands();
+        command_recognizer_.OnCommand([this](int command_id) {
+            Schedule([this, command_id]() {
+                HandleLocalCommand(command_id);
+            });
+        });
+        command_recognizer_.Start();
+    }
+#endif
+#if CONFIG_USE_WAKE_WORD_GATE
+    wake_word_gate_.Configure(CONFIG_WAKE_WORD_GATE_THRESHOLD_DB, CONFIG_WAKE_WORD_GATE_LOOKBACK_MS,
+        CONFIG_WAKE_WORD_GATE_HANGOVER_MS);
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
     // wake_word_detect_.Initialize(codec);
     // wake_word_detect_.OnWakeWordDetected([this](const std::string& wake_word) { ... });
@@ -553,6 +673,11 @@ void Application::Start() {
             }); 
         });
         
+        // 卡片应答 ATQA 后还要读取卡内数据，先建立连接
+        nfc_t->OnNfcCardPresent([this]() {
+            Preconnect("nfc card");
+        });
+
         nfc_t->OnNfcDisCon([this](void){
             if (device_state_ == kDeviceStateSpeaking) {
                 AbortSpeaking(kAbortReasonNone);
@@ -606,6 +731,67 @@ void Application::OnClockTimer() {
         int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
         ESP_LOGI(TAG, "Free internal: %u minimal internal: %u", free_sram, min_free_sram);
 
+#if CONFIG_USE_UPLINK_DTX_SUPPRESSION
+        uint32_t dtx_frames = dtx_frames_.exchange(0);
+        if (dtx_frames > 0) {
+            ESP_LOGI(TAG, "DTX frames: %lu, suppressed: %lu", dtx_frames, dtx_frames_suppressed_.exchange(0));
+        }
+#endif
+
+#if CONFIG_USE_WAKE_WORD_GATE
+        if (device_state_ == kDeviceStateIdle) {
+            ESP_LOGI(TAG, "Idle audio gate open %d%% of the time", wake_word_gate_.TakeOpenPercent());
+        }
+#endif
+
+        // Levels of the last frame, and any clipping in the last 10 seconds
+        auto capture = capture_level_.GetLevel();
+        auto playback = playback_level_.GetLevel();
+        ESP_LOGI(TAG, "Capture level: rms %.1f dBFS peak %.1f dBFS, playback level: rms %.1f dBFS peak %.1f dBFS",
+            capture.rms_dbfs(), capture.peak_dbfs(), playback.rms_dbfs(), playback.peak_dbfs());
+        uint32_t capture_clipped = capture_level_.TakeClippedSamples();
+        uint32_t playback_clipped = playback_level_.TakeClippedSamples();
+        if (capture_clipped > 0 || playback_clipped > 0) {
+            ESP_LOGW(TAG, "Clipped samples: capture %lu, playback %lu", capture_clipped, playback_clipped);
+        }
+
+#if CONFIG_USE_DRIFT_COMPENSATION
+        int adjusted_samples = drift_compensator_.TakeAdjustedSamples();
+        if (adjusted_samples != 0) {
+            ESP_LOGI(TAG, "Clock drift: %d ppm, correction: %d ppm, %d samples adjusted",
+                drift_compensator_.drift_ppm(), drift_compensator_.correction_ppm(), adjusted_samples);
+        }
+#endif
+
+        if (protocol_) {
+            auto stream = protocol_->TakeAudioStreamStats();
+            if (stream.lost_packets > 0 || stream.late_packets > 0) {
+                ESP_LOGW(TAG, "Audio received: %lu packets, lost %lu, late %lu, concealed %lu frames, max delay %d ms",
+                    stream.received_packets, stream.lost_packets, stream.late_packets, stream.concealed_frames, stream.max_delay_ms);
+            } else if (stream.received_packets > 0) {
+                ESP_LOGI(TAG, "Audio received: %lu packets, max delay %d ms", stream.received_packets, stream.max_delay_ms);
+            }
+        }
+
+        uint32_t dropped_packets = tts_spool_.TakeDroppedPackets();
+        size_t dropped_bytes = tts_spool_.TakeDroppedBytes();
+        if (dropped_packets > 0) {
+            ESP_LOGW(TAG, "TTS spool dropped %lu packets, %u bytes", dropped_packets, dropped_bytes);
+        }
+#if CONFIG_USE_UPLINK_WRITER
+        uint32_t uplink_dropped = uplink_writer_.TakeDroppedPackets();
+        if (uplink_dropped > 0) {
+            ESP_LOGW(TAG, "Uplink queue full, dropped %lu packets", uplink_dropped);
+        }
+#endif
+
+        // Core time spent resampling capture data, zero when the codec already runs at 16kHz
+        int64_t resample_time_us = input_resample_time_us_.exchange(0);
+        if (resample_time_us > 0) {
+            ESP_LOGI(TAG, "Input resampling: %lld ms in 10s (%.2f%% of one core)",
+                resample_time_us / 1000, resample_time_us / 100000.0);
+        }
+
         // If we have synchronized server time, set the status to clock "HH:MM" if the device is idle
         // if (ota_.HasServerTime()) {
         //     if (device_state_ == kDeviceStateIdle) {
@@ -659,50 +845,138 @@ void Application::AudioLoop() {
     }
 }
 
+// Decoded packets the audio loop may queue ahead of the codec, enough to keep the DMA fed
+#define MAX_PLAYOUT_PACKETS_IN_FLIGHT 3
+
 void Application::OnAudioOutput() {
     auto now = std::chrono::steady_clock::now();
     auto codec = Board::GetInstance().GetAudioCodec();
     const int max_silence_seconds = 10;
 
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (audio_decode_queue_.empty()) {
-        // Disable the output if there is no audio data for a long time
-        if (device_state_ == kDeviceStateIdle) {
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
-            if (duration > max_silence_seconds) {
-                codec->EnableOutput(false);
-            }
-        }
+    // Prompts go ahead of the TTS stream and use their own decoder
+    int playout_depth_ms = -1;
+    std::vector<uint8_t> opus;
+    PromptSequencer::CompletionCallback on_prompt_complete;
+    uint32_t prompt_generation = 0;
+    OpusDecoderWrapper* decoder = nullptr;
+    if (device_state_ == kDeviceStateListening) {
+        prompt_sequencer_.Clear();
+    } else if (!prompt_sequencer_.IsEmpty() && prompt_packets_ >= MAX_PLAYOUT_PACKETS_IN_FLIGHT) {
+        // Like the TTS stream, a prompt is pulled only as fast as it plays, so a preemption or a
+        // clear still finds most of it in the sequencer
         return;
+    } else if (prompt_sequencer_.NextPacket(opus, on_prompt_complete, prompt_generation)) {
+        decoder = prompt_sequencer_.decoder();
+        prompt_packets_++;
     }
 
-    if (device_state_ == kDeviceStateListening) {
-        audio_decode_queue_.clear();
-        return;
+    if (decoder == nullptr) {
+        if (tts_spool_.IsEmpty()) {
+            if (tts_spool_.TakeDrained()) {
+                Schedule([this]() {
+                    FinishSpeaking();
+                });
+            }
+            // Disable the output if there is no audio data for a long time
+            if (device_state_ == kDeviceStateIdle) {
+                auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
+#if CONFIG_USE_OUTPUT_KEEP_WARM
+                if (duration > CONFIG_OUTPUT_DEEP_OFF_SECONDS) {
+                    codec->EnableOutput(false);
+                } else if (duration > max_silence_seconds) {
+                    codec->SetOutputMute(true);
+                }
+#else
+                if (duration > max_silence_seconds) {
+                    codec->EnableOutput(false);
+                }
+#endif
+            }
+            return;
+        }
+
+        if (device_state_ == kDeviceStateListening) {
+            // Clear asks the server to resume, which only matters when something was spooled
+            if (!tts_spool_.IsEmpty()) {
+                UpdateFlowControl(tts_spool_.Clear());
+            }
+            return;
+        }
+
+        // Keep only a few packets in the background task, the rest of a burst waits in the spool
+        TtsFlowTransition flow = kTtsFlowNone;
+        if (playout_packets_ >= MAX_PLAYOUT_PACKETS_IN_FLIGHT || !tts_spool_.Pop(opus, &flow)) {
+            return;
+        }
+        UpdateFlowControl(flow);
+        // Pooled decoders stay alive after a switch, so the task can keep the one it was queued for
+        decoder = opus_decoder_;
+        playout_packets_++;
+#if CONFIG_USE_DRIFT_COMPENSATION
+        // Everything received but not played yet, including the packets waiting in the background task.
+        // Once the answer is fully received the depth only falls, which says nothing about the clocks
+        if (!tts_spool_.IsComplete()) {
+            playout_depth_ms = (tts_spool_.packets() + playout_packets_) * decoder->duration_ms();
+        }
+#endif
     }
 
-    auto opus = std::move(audio_decode_queue_.front());
-    audio_decode_queue_.pop_front();
-    lock.unlock();
+    if (codec->output_muted()) {
+        codec->SetOutputMute(false);
+    }
 
-    background_task_->Schedule([this, codec, opus = std::move(opus)]() mutable {
-        if (aborted_) {
+    bool is_prompt = decoder == prompt_sequencer_.decoder();
+    background_task_->Schedule([this, codec, decoder, is_prompt, prompt_generation, playout_depth_ms, opus = std::move(opus),
+        on_prompt_complete = std::move(on_prompt_complete)]() mutable {
+        if (is_prompt) {
+            prompt_packets_--;
+            // Cut off by a preemption or a clear, whose lists were completed with false already.
+            // Only the last packet of a list still carries its callback
+            if (!prompt_sequencer_.IsCurrent(prompt_generation)) {
+                if (on_prompt_complete) {
+                    on_prompt_complete(false);
+                }
+                return;
+            }
+            // The cut off prompt left the decoder in the middle of its frame sequence
+            if (prompt_generation != prompt_decoded_generation_) {
+                decoder->ResetState();
+                prompt_decoded_generation_ = prompt_generation;
+            }
+        } else {
+            playout_packets_--;
+        }
+        // Aborting only drops the TTS stream, prompts still play
+        if (aborted_ && !is_prompt) {
             return;
         }
 
         std::vector<int16_t> pcm;
-        if (!opus_decoder_->Decode(std::move(opus), pcm)) {
+        if (!decoder->Decode(std::move(opus), pcm)) {
+            if (on_prompt_complete) {
+                on_prompt_complete(false);
+            }
             return;
         }
         // Resample if the sample rate is different
-        if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
+        if (decoder->sample_rate() != codec->output_sample_rate()) {
             int target_size = output_resampler_.GetOutputSamples(pcm.size());
             std::vector<int16_t> resampled(target_size);
             output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
             pcm = std::move(resampled);
         }
+#if CONFIG_USE_DRIFT_COMPENSATION
+        if (playout_depth_ms >= 0) {
+            drift_compensator_.Update(esp_timer_get_time(), playout_depth_ms);
+            drift_compensator_.Process(pcm, codec->output_channels());
+        }
+#endif
+        playback_level_.Process(pcm.data(), pcm.size(), codec->output_channels());
         codec->OutputData(pcm);
         last_output_time_ = std::chrono::steady_clock::now();
+        if (on_prompt_complete) {
+            on_prompt_complete(true);
+        }
     });
 }
 
@@ -711,26 +985,52 @@ void Application::OnAudioInput() {
 
 #if CONFIG_USE_WAKE_WORD_DETECT
     if (wake_word_detect_.IsDetectionRunning()) {
-        ReadAudio(data, 16000, wake_word_detect_.GetFeedSize());
+        ReadAudio(data, wake_word_detect_.GetFeedSize());
+#if CONFIG_USE_WAKE_WORD_GATE
+        // The AFE task blocks on fetch while nothing is fed, so a closed gate keeps core 1 idle
+        int channels = Board::GetInstance().GetAudioCodec()->input_channels();
+        wake_word_gate_.Process(std::move(data), channels, [this](const std::vector<int16_t>& chunk) {
+            wake_word_detect_.Feed(chunk);
+        });
+#else
         wake_word_detect_.Feed(data);
+#endif
         return;
     }
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
     if (audio_processor_.IsRunning()) {
-        ReadAudio(data, 16000, audio_processor_.GetFeedSize());
+        ReadAudio(data, audio_processor_.GetFeedSize());
         audio_processor_.Feed(data);
         return;
     }
-#else
-    if (device_state_ == kDeviceStateListening) {
-        ReadAudio(data, 16000, 30 * 16000 / 1000);
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
-                });
+#endif
+#if CONFIG_USE_LOCAL_COMMANDS
+    // The commands are only listened for while the microphone is not streaming to the server,
+    // and while speaking only if the recognizer can cancel the playback from the microphone
+    if (command_recognizer_.IsRunning() && (device_state_ == kDeviceStateIdle ||
+        (device_state_ == kDeviceStateSpeaking && command_recognizer_.cancels_echo()))) {
+        int channels = Board::GetInstance().GetAudioCodec()->input_channels();
+        ReadAudio(data, command_recognizer_.GetFeedSize() * channels);
+#if CONFIG_USE_WAKE_WORD_GATE
+        // Idle is where the device spends most of its time, MultiNet waits for chunks while the gate is closed
+        if (device_state_ == kDeviceStateIdle) {
+            wake_word_gate_.Process(std::move(data), channels, [this, channels](const std::vector<int16_t>& chunk) {
+                command_recognizer_.Feed(chunk, channels);
             });
+            return;
+        }
+#endif
+        command_recognizer_.Feed(data, channels);
+        return;
+    }
+#endif
+#if !CONFIG_USE_AUDIO_PROCESSOR
+    if (device_state_ == kDeviceStateListening) {
+        ReadAudio(data, 30 * 16000 / 1000);
+        int64_t capture_time_us = last_capture_end_us_ - 30 * 1000;
+        background_task_->Schedule([this, capture_time_us, data = std::move(data)]() mutable {
+            EncodeAudio(std::move(data), capture_time_us);
         });
         return;
     }
@@ -738,48 +1038,328 @@ void Application::OnAudioInput() {
     vTaskDelay(pdMS_TO_TICKS(30));
 }
 
-void Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples) {
+// Capture path specialized on resampling and channel count, kChannels == 0 reads the count at run time.
+// The codec does not change after Start, so the specialization is picked once in SelectCapturePipeline
+template <bool kResample, int kChannels>
+void Application::ReadAudioImpl(std::vector<int16_t>& data, int samples) {
     auto codec = Board::GetInstance().GetAudioCodec();
-    if (codec->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec->input_sample_rate() / sample_rate);
-        if (!codec->InputData(data)) {
+    const int channels = kChannels > 0 ? kChannels : codec->input_channels();
+    if constexpr (kResample) {
+        input_buffer_.resize(samples * codec->input_sample_rate() / 16000);
+        if (!codec->InputData(input_buffer_)) {
             return;
         }
-        if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
+        int64_t start_time = esp_timer_get_time();
+        // InputData returns as soon as the DMA holds the whole chunk, so its last sample was captured just now
+        last_capture_end_us_ = start_time;
+        if (channels == 2) {
+            mic_channel_.resize(input_buffer_.size() / 2);
+            reference_channel_.resize(input_buffer_.size() / 2);
+            for (size_t i = 0, j = 0; i < mic_channel_.size(); ++i, j += 2) {
+                mic_channel_[i] = input_buffer_[j];
+                reference_channel_[i] = input_buffer_[j + 1];
             }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
+            resampled_mic_.resize(input_resampler_.GetOutputSamples(mic_channel_.size()));
+            resampled_reference_.resize(reference_resampler_.GetOutputSamples(reference_channel_.size()));
+            input_resampler_.Process(mic_channel_.data(), mic_channel_.size(), resampled_mic_.data());
+            reference_resampler_.Process(reference_channel_.data(), reference_channel_.size(), resampled_reference_.data());
+            data.resize(resampled_mic_.size() + resampled_reference_.size());
+            for (size_t i = 0, j = 0; i < resampled_mic_.size(); ++i, j += 2) {
+                data[j] = resampled_mic_[i];
+                data[j + 1] = resampled_reference_[i];
             }
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            data.resize(input_resampler_.GetOutputSamples(input_buffer_.size()));
+            input_resampler_.Process(input_buffer_.data(), input_buffer_.size(), data.data());
         }
+        input_resample_time_us_ += esp_timer_get_time() - start_time;
     } else {
         data.resize(samples);
         if (!codec->InputData(data)) {
             return;
         }
+        last_capture_end_us_ = esp_timer_get_time();
+    }
+    capture_level_.Process(data.data(), data.size(), channels);
+}
+
+void Application::SelectCapturePipeline() {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    bool resample = codec->input_sample_rate() != 16000;
+    switch (codec->input_channels()) {
+        case 1:
+            read_audio_ = resample ? &Application::ReadAudioImpl<true, 1> : &Application::ReadAudioImpl<false, 1>;
+            break;
+        case 2:
+            read_audio_ = resample ? &Application::ReadAudioImpl<true, 2> : &Application::ReadAudioImpl<false, 2>;
+            break;
+        default:
+            read_audio_ = resample ? &Application::ReadAudioImpl<true, 0> : &Application::ReadAudioImpl<false, 0>;
+            break;
+    }
+    ESP_LOGI(TAG, "Capture pipeline: %d channels, %s", codec->input_channels(),
+        resample ? "resampled to 16000Hz" : "16000Hz");
+}
+
+// The server only needs silence frames when it endpoints the utterance with its own VAD
+bool Application::CanSuppressSilence() const {
+    if (listening_mode_ == kListeningModeManualStop) {
+        return true;
     }
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    if (listening_mode_ == kListeningModeAutoStop) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Runs on the background task. The encoder keeps the remainder of a frame between calls, so the
+// capture time of each frame is counted on from the first sample it buffered
+void Application::EncodeAudio(std::vector<int16_t>&& pcm, int64_t capture_time_us) {
+    if (encode_buffered_samples_ == 0) {
+        encode_start_us_ = capture_time_us;
+    }
+    encode_buffered_samples_ += pcm.size();
+    opus_encoder_->Encode(std::move(pcm), [this](std::vector<uint8_t>&& opus) {
+        uint32_t timestamp = encode_start_us_ / 1000;
+        encode_start_us_ += opus_encoder_->duration_ms() * 1000;
+        encode_buffered_samples_ -= opus_encoder_->sample_rate() / 1000 * opus_encoder_->duration_ms();
+        OnAudioEncoded(std::move(opus), timestamp);
+    });
+}
+
+// Called on the background task for every encoded frame
+void Application::OnAudioEncoded(std::vector<uint8_t>&& opus, uint32_t timestamp) {
+#if CONFIG_USE_UPLINK_DTX_SUPPRESSION
+    // With DTX the encoder emits 1-2 byte comfort noise frames during silence
+    if (opus.size() <= 2) {
+        dtx_frames_++;
+        if (CanSuppressSilence()) {
+            if (dtx_silence_ms_ == 0) {
+#if CONFIG_USE_OPUS_REPACKETIZER
+                // Do not hold the tail of the speech back while the silence is dropped
+                opus_repacketizer_.Flush([this](std::vector<uint8_t>&& packet) {
+                    SendRepacketized(std::move(packet));
+                });
+#endif
+            }
+            dtx_silence_ms_ += OPUS_ENCODE_FRAME_DURATION_MS;
+            if (dtx_silence_ms_ < CONFIG_DTX_KEEPALIVE_MS) {
+                dtx_frames_suppressed_++;
+                return;
+            }
+            // Send one frame now and then to keep the stream alive
+            dtx_silence_ms_ = OPUS_ENCODE_FRAME_DURATION_MS;
+        }
+    } else {
+        dtx_silence_ms_ = 0;
+    }
+#endif
+#if CONFIG_USE_OPUS_REPACKETIZER
+    if (repacketizer_frames_ == 0) {
+        repacketizer_timestamp_ = timestamp;
+    }
+    repacketizer_frames_++;
+    opus_repacketizer_.SetFramesPerPacket(uplink_frames_per_packet_);
+    opus_repacketizer_.Push(std::move(opus), [this](std::vector<uint8_t>&& packet) {
+        SendRepacketized(std::move(packet));
+    });
+#else
+    SendAudio(AudioStreamPacket{std::move(opus), timestamp});
+#endif
+}
+
+#if CONFIG_USE_OPUS_REPACKETIZER
+// The packets leave the repacketizer in order, each one starts with the oldest frame still in it
+void Application::SendRepacketized(std::vector<uint8_t>&& packet) {
+    int duration_ms = opus_packet_get_nb_samples(packet.data(), packet.size(), 16000) / 16;
+    int frames = std::max(1, duration_ms / OPUS_ENCODE_FRAME_DURATION_MS);
+    uint32_t timestamp = repacketizer_timestamp_;
+    repacketizer_timestamp_ += frames * OPUS_ENCODE_FRAME_DURATION_MS;
+    repacketizer_frames_ = std::max(0, repacketizer_frames_ - frames);
+    SendAudio(AudioStreamPacket{std::move(packet), timestamp});
+}
+#endif
+
+void Application::SendAudio(AudioStreamPacket&& packet) {
+#if CONFIG_USE_UPLINK_WRITER
+    // Straight to the writer task, a full queue is counted and reported in OnClockTimer
+    uplink_writer_.Push(std::move(packet));
+#else
+    // One scheduled send takes all packets queued until it runs, so a stalled main loop does not
+    // pile up a task per packet
+    bool schedule;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        schedule = pending_uplink_.empty();
+        pending_uplink_.push_back(std::move(packet));
+    }
+    if (schedule) {
+        Schedule([this]() {
+            SendPendingAudio();
+        });
+    }
+#endif
+}
+
+#if !CONFIG_USE_UPLINK_WRITER
+// Runs on the main loop. The packets are kept in order in one list, so FlushUplink can send
+// them ahead of a control message instead of leaving them in the queue behind it
+void Application::SendPendingAudio() {
+    std::list<AudioStreamPacket> packets;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        packets = std::move(pending_uplink_);
+    }
+    for (auto& packet : packets) {
+        int64_t start_time = esp_timer_get_time();
+        protocol_->SendAudio(packet);
+        AdaptUplinkPacketing(esp_timer_get_time() - start_time, 0);
+    }
+}
+#endif
+
+// A slow send or packets piling up mean the link is backing up, merge more frames per packet
+// to cut overhead; a fast link gets the advertised packet duration back for lower latency
+void Application::AdaptUplinkPacketing(int64_t send_time_us, size_t backlog) {
+#if CONFIG_USE_OPUS_REPACKETIZER
+    uplink_send_time_us_ = (uplink_send_time_us_ * 7 + send_time_us) / 8;
+
+    if (uplink_adapt_holdoff_ > 0) {
+        uplink_adapt_holdoff_--;
+        return;
+    }
+    int frames = uplink_frames_per_packet_;
+    bool slow = uplink_send_time_us_ > frames * OPUS_ENCODE_FRAME_DURATION_MS * 1000 / 2 || backlog >= 2;
+    if (slow && frames < opus_repacketizer_.max_frames_per_packet()) {
+        uplink_frames_per_packet_ = frames + 1;
+        uplink_adapt_holdoff_ = 16;
+        ESP_LOGI(TAG, "Uplink is slow, merge %d frames per packet", frames + 1);
+    } else if (uplink_send_time_us_ < 2000 && backlog == 0 && frames > UPLINK_MIN_FRAMES_PER_PACKET) {
+        uplink_frames_per_packet_ = frames - 1;
+        uplink_adapt_holdoff_ = 16;
+        ESP_LOGI(TAG, "Uplink is fast, merge %d frames per packet", frames - 1);
+    }
+#endif
+}
+
+#define UPLINK_FLUSH_TIMEOUT_MS 200
+
+// Called on the main loop before a control message that ends the audio. Everything captured
+// so far is encoded, the frames left in the repacketizer are sent as the last packet, and the
+// audio still queued goes out ahead of the message
+void Application::FlushUplink() {
+#if CONFIG_USE_OPUS_REPACKETIZER
+    background_task_->Schedule([this]() {
+        opus_repacketizer_.Flush([this](std::vector<uint8_t>&& packet) {
+            SendRepacketized(std::move(packet));
+        });
+    });
+#endif
+    background_task_->WaitForCompletion();
+#if CONFIG_USE_UPLINK_WRITER
+    uplink_writer_.WaitForIdle(UPLINK_FLUSH_TIMEOUT_MS);
+#else
+    SendPendingAudio();
+#endif
 }
 
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    UpdateFlowControl(tts_spool_.Clear());
     protocol_->SendAbortSpeaking(reason);
 }
 
+void Application::ChangeOutputVolume(int delta, bool stop_playback) {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    auto volume = codec->output_volume() + delta;
+    if (stop_playback) {
+        ResetDecoder();
+    }
+    if (delta > 0 && volume > 100) {
+        volume = 100;
+        Alert("提示", "音量已达最大值", "", Lang::Sounds::P3_VOL_MAX);
+    } else if (delta < 0 && volume < 50) {
+        volume = 50;
+        Alert("提示", "音量已达最小值", "", Lang::Sounds::P3_VOL_MIN);
+    } else {
+        Alert("提示", delta > 0 ? "音量加" : "音量减", "", delta > 0 ? Lang::Sounds::P3_VOL_UP : Lang::Sounds::P3_VOL_DOWN);
+    }
+    codec->SetOutputVolume(volume);
+}
+
+#if CONFIG_USE_LOCAL_COMMANDS
+// Runs on the main loop, without going through the server
+void Application::HandleLocalCommand(int command_id) {
+    switch (command_id) {
+        // The answer plays on at the new volume, the prompt has its own decoder
+        case kLocalCommandVolumeUp:
+            ChangeOutputVolume(10, false);
+            break;
+        case kLocalCommandVolumeDown:
+            ChangeOutputVolume(-10, false);
+            break;
+        case kLocalCommandPause:
+            if (device_state_ == kDeviceStateSpeaking) {
+                AbortSpeaking(kAbortReasonNone);
+            }
+            break;
+        case kLocalCommandStop:
+            if (device_state_ == kDeviceStateSpeaking) {
+                AbortSpeaking(kAbortReasonNone);
+            }
+            if (protocol_ && protocol_->IsAudioChannelOpened()) {
+                protocol_->CloseAudioChannel();
+            }
+            SetDeviceState(kDeviceStateIdle);
+            break;
+        default:
+            break;
+    }
+}
+#endif
+
+#if CONFIG_USE_DEVICE_ENDPOINTING
+// The device ended the utterance but the server never started an answer, e.g. the speech
+// was not recognized or the server failed
+void Application::OnResponseTimeout() {
+    if (device_state_ != kDeviceStateListening || !endpoint_detector_.triggered()) {
+        return;
+    }
+    ESP_LOGW(TAG, "No answer %d ms after the end of speech, back to idle", CONFIG_ENDPOINT_RESPONSE_TIMEOUT_MS);
+    SetDeviceState(kDeviceStateIdle);
+}
+#endif
+
+// Called on the main loop when the answer has been received and handed over for playback
+void Application::FinishSpeaking() {
+    background_task_->WaitForCompletion();
+    if (device_state_ == kDeviceStateSpeaking) {
+        if (listening_mode_ == kListeningModeManualStop) {
+            SetDeviceState(kDeviceStateIdle);
+        } else {
+            SetDeviceState(kDeviceStateListening);
+        }
+    }
+}
+
+// Called after every change of the spool, from the network task and the audio loop.
+// The spool decides the transition under its own lock, so pause and resume alternate however the two race
+void Application::UpdateFlowControl(TtsFlowTransition flow) {
+#if CONFIG_USE_TTS_FLOW_CONTROL
+    if (flow == kTtsFlowNone) {
+        return;
+    }
+    bool pause = flow == kTtsFlowPause;
+    ESP_LOGI(TAG, "TTS spool %d%% full, ask the server to %s", tts_spool_.fill_percent(), pause ? "pause" : "resume");
+    Schedule([this, pause]() {
+        protocol_->SendFlowControl(pause);
+    });
+#endif
+}
+
 void Application::SetListeningMode(ListeningMode mode) {
     listening_mode_ = mode;
     SetDeviceState(kDeviceStateListening);
@@ -791,6 +1371,9 @@ void Application::SetDeviceState(DeviceState state) {
     }
     
     clock_ticks_ = 0;
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    esp_timer_stop(response_timer_handle_);
+#endif
     auto previous_state = device_state_;
     device_state_ = state;
     ESP_LOGI(TAG, "STATE: %s", STATE_STRINGS[device_state_]);
@@ -807,6 +1390,9 @@ void Application::SetDeviceState(DeviceState state) {
 #if CONFIG_USE_AUDIO_PROCESSOR
             audio_processor_.Stop();
 #endif
+#if CONFIG_USE_WAKE_WORD_GATE
+            wake_word_gate_.Reset();
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
             // wake_word_detect_.StartDetection();
 #endif
@@ -819,6 +1405,12 @@ void Application::SetDeviceState(DeviceState state) {
             if (!audio_processor_.IsRunning()) {
 #else
             if (true) {
+#endif
+#if CONFIG_USE_TTS_EARLY_RADIO_SLEEP
+                // The radio may have gone to power save while the answer played from the spool
+                if (protocol_->IsAudioChannelOpened()) {
+                    board.SetPowerSaveMode(false);
+                }
 #endif
                 // Send the start listening command
                 protocol_->SendStartListening(listening_mode_);
@@ -827,6 +1419,17 @@ void Application::SetDeviceState(DeviceState state) {
                     vTaskDelay(pdMS_TO_TICKS(120));
                 }
                 opus_encoder_->ResetState();
+                encode_buffered_samples_ = 0;
+#if CONFIG_USE_UPLINK_DTX_SUPPRESSION
+                dtx_silence_ms_ = 0;
+#endif
+#if CONFIG_USE_OPUS_REPACKETIZER
+                opus_repacketizer_.ResetState();
+                repacketizer_frames_ = 0;
+#endif
+#if CONFIG_USE_DEVICE_ENDPOINTING
+                endpoint_detector_.Reset();
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
                 // wake_word_detect_.StopDetection();
                 // voice_interruption->StopDetection();
@@ -859,13 +1462,26 @@ void Application::SetDeviceState(DeviceState state) {
 }
 
 void Application::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    opus_decoder_->ResetState();
-    audio_decode_queue_.clear();
+    TtsFlowTransition flow;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        opus_decoder_->ResetState();
+        flow = tts_spool_.Clear();
+#if CONFIG_USE_DRIFT_COMPENSATION
+        drift_compensator_.Reset();
+#endif
+        WakeOutput();
+    }
+    // Schedule takes mutex_, so the server is told after the lock is released
+    UpdateFlowControl(flow);
+}
+
+void Application::WakeOutput() {
     last_output_time_ = std::chrono::steady_clock::now();
-    
+
     auto codec = Board::GetInstance().GetAudioCodec();
     codec->EnableOutput(true);
+    codec->SetOutputMute(false);
 }
 
 void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
@@ -873,11 +1489,18 @@ void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
         return;
     }
 
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    // Evicting a decoder frees it, make sure no queued decode still refers to it
+    if (!opus_decoder_pool_.Contains(sample_rate, frame_duration) && opus_decoder_pool_.IsFull()) {
+        background_task_->WaitForCompletion();
+    }
+    auto decoder = opus_decoder_pool_.Get(sample_rate, frame_duration);
+    // A warm decoder still holds the tail of its previous stream
+    decoder->ResetState();
+    opus_decoder_ = decoder;
 
     auto codec = Board::GetInstance().GetAudioCodec();
-    if (codec && opus_decoder_->sample_rate() != codec->output_sample_rate()) {
+    if (codec && opus_decoder_->sample_rate() != codec->output_sample_rate() &&
+        output_resampler_.input_sample_rate() != opus_decoder_->sample_rate()) {
         ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
         output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
     }
@@ -909,6 +1532,22 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     }
 }
 
+// Called from the button and NFC tasks when a conversation is likely to start, so the
+// connection is set up while the trigger is still being recognized
+void Application::Preconnect(const char* reason) {
+#if CONFIG_USE_SPECULATIVE_PRECONNECT
+    if (device_state_ != kDeviceStateIdle || !protocol_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Preconnect on %s", reason);
+    Schedule([this]() {
+        if (device_state_ == kDeviceStateIdle && !protocol_->IsAudioChannelOpened()) {
+            protocol_->Preconnect();
+        }
+    });
+#endif
+}
+
 bool Application::CanEnterSleepMode() {
     if (device_state_ != kDeviceStateIdle) {
         return false;
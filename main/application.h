@@ -9,14 +9,26 @@
 #include <string>
 #include <mutex>
 #include <list>
+#include <atomic>
 
 #include <opus_encoder.h>
 #include <opus_decoder.h>
 #include <opus_resampler.h>
+#include <opus_repacketizer.h>
 
 #include "protocol.h"
 #include "ota.h"
 #include "background_task.h"
+#include "opus_decoder_pool.h"
+#include "prompt_sequencer.h"
+#include "level_meter.h"
+#include "tts_spool.h"
+#if CONFIG_USE_DRIFT_COMPENSATION
+#include "drift_compensator.h"
+#endif
+#if CONFIG_USE_UPLINK_WRITER
+#include "uplink_writer.h"
+#endif
 
 #if CONFIG_USE_WAKE_WORD_DETECT
 #include "wake_word_detect.h"
@@ -24,6 +36,15 @@
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "audio_processor.h"
 #endif
+#if CONFIG_USE_DEVICE_ENDPOINTING
+#include "endpoint_detector.h"
+#endif
+#if CONFIG_USE_WAKE_WORD_GATE
+#include "energy_gate.h"
+#endif
+#if CONFIG_USE_LOCAL_COMMANDS
+#include "command_recognizer.h"
+#endif
 
 #define SCHEDULE_EVENT (1 << 0)
 #define AUDIO_INPUT_READY_EVENT (1 << 1)
@@ -47,7 +68,23 @@ enum DeviceState {
     kDeviceStateFatalError
 };
 
+enum LocalCommand {
+    kLocalCommandVolumeUp = 1,
+    kLocalCommandVolumeDown,
+    kLocalCommandPause,
+    kLocalCommandStop
+};
+
 #define OPUS_FRAME_DURATION_MS 60
+#if CONFIG_USE_OPUS_REPACKETIZER
+#define OPUS_ENCODE_FRAME_DURATION_MS CONFIG_OPUS_ENCODE_FRAME_DURATION_MS
+// The hello advertises OPUS_FRAME_DURATION_MS, so a packet never carries less. A slow uplink may
+// merge up to the longest packet Opus allows
+#define UPLINK_MIN_FRAMES_PER_PACKET ((OPUS_FRAME_DURATION_MS + OPUS_ENCODE_FRAME_DURATION_MS - 1) / OPUS_ENCODE_FRAME_DURATION_MS)
+#define UPLINK_MAX_FRAMES_PER_PACKET (120 / OPUS_ENCODE_FRAME_DURATION_MS)
+#else
+#define OPUS_ENCODE_FRAME_DURATION_MS OPUS_FRAME_DURATION_MS
+#endif
 
 class Application {
 public:
@@ -64,7 +101,8 @@ public:
     bool IsVoiceDetected() const { return voice_detected_; }
     void Schedule(std::function<void()> callback);
     void SetDeviceState(DeviceState state);
-    void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
+    void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "",
+        PromptPriority priority = kPromptPriorityInfo);
     void DismissAlert();
     void AbortSpeaking(AbortReason reason);
     void ToggleChatState();
@@ -73,7 +111,13 @@ public:
     void Reboot();
     void WakeWordInvoke(const std::string& wake_word);
     void PlaySound(const std::string_view& sound);
+    // 连续播放一组提示音，on_complete 在后台任务中调用
+    void PlayPrompts(std::vector<std::string_view> sounds, PromptPriority priority = kPromptPriorityInfo,
+        PromptSequencer::CompletionCallback on_complete = nullptr);
     bool CanEnterSleepMode();
+    // 采集与播放的实时电平，任意任务都可以读取
+    const LevelMeter& capture_level() const { return capture_level_; }
+    const LevelMeter& playback_level() const { return playback_level_; }
 
 private:
     Application();
@@ -84,6 +128,15 @@ private:
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
     AudioProcessor audio_processor_;
+#endif
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    EndpointDetector endpoint_detector_;
+#endif
+#if CONFIG_USE_WAKE_WORD_GATE
+    EnergyGate wake_word_gate_;
+#endif
+#if CONFIG_USE_LOCAL_COMMANDS
+    CommandRecognizer command_recognizer_;
 #endif
     Ota ota_;
     std::mutex mutex_;
@@ -91,6 +144,14 @@ private:
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    // Started when the device ends the utterance, stopped by any state change
+    esp_timer_handle_t response_timer_handle_ = nullptr;
+#endif
+#if CONFIG_USE_SPECULATIVE_PRECONNECT
+    // Started on press down, a press that lasts until it fires is likely to become a long press
+    esp_timer_handle_t preconnect_timer_handle_ = nullptr;
+#endif
     volatile DeviceState device_state_ = kDeviceStateUnknown;
     ListeningMode listening_mode_ = kListeningModeAutoStop;
 #if CONFIG_USE_REALTIME_CHAT
@@ -108,27 +169,112 @@ private:
     TaskHandle_t audio_loop_task_handle_ = nullptr;
     BackgroundTask* background_task_ = nullptr;
     std::chrono::steady_clock::time_point last_output_time_;
-    std::list<std::vector<uint8_t>> audio_decode_queue_;
+#if CONFIG_USE_TTS_FLOW_CONTROL
+    TtsSpool tts_spool_{CONFIG_TTS_SPOOL_SIZE_KB * 1024, CONFIG_TTS_SPOOL_MAX_PACKETS,
+        CONFIG_TTS_FLOW_PAUSE_PERCENT, CONFIG_TTS_FLOW_RESUME_PERCENT};
+#else
+    TtsSpool tts_spool_{CONFIG_TTS_SPOOL_SIZE_KB * 1024, CONFIG_TTS_SPOOL_MAX_PACKETS};
+#endif
 
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
+#if CONFIG_USE_OPUS_REPACKETIZER
+    // Only used by the background task that runs the encoder
+    OpusRepacketizerWrapper opus_repacketizer_{UPLINK_MAX_FRAMES_PER_PACKET};
+    std::atomic<int> uplink_frames_per_packet_{UPLINK_MIN_FRAMES_PER_PACKET};
+    // Capture time of the oldest frame in the repacketizer, only used by the background task
+    uint32_t repacketizer_timestamp_ = 0;
+    int repacketizer_frames_ = 0;
+    // Only used by the task that sends the audio
+    int64_t uplink_send_time_us_ = 0;
+    int uplink_adapt_holdoff_ = 0;
+#endif
+#if CONFIG_USE_UPLINK_WRITER
+    UplinkWriter uplink_writer_{CONFIG_UPLINK_QUEUE_PACKETS};
+#else
+    // Encoded packets waiting for the main loop, guarded by mutex_
+    std::list<AudioStreamPacket> pending_uplink_;
+#endif
+#if CONFIG_USE_UPLINK_DTX_SUPPRESSION
+    // Only used by the background task that runs the encoder
+    int dtx_silence_ms_ = 0;
+    std::atomic<uint32_t> dtx_frames_{0};
+    std::atomic<uint32_t> dtx_frames_suppressed_{0};
+#endif
+    OpusDecoderPool opus_decoder_pool_;
+    OpusDecoderWrapper* opus_decoder_ = nullptr;
+    PromptSequencer prompt_sequencer_;
+    // TTS packets handed to the background task and not played yet
+    std::atomic<int> playout_packets_{0};
+    // The same for prompt packets
+    std::atomic<int> prompt_packets_{0};
+    // Generation of the last prompt packet decoded, only used by the background task
+    uint32_t prompt_decoded_generation_ = 0;
+#if CONFIG_USE_DRIFT_COMPENSATION
+    DriftCompensator drift_compensator_{CONFIG_PLAYOUT_TARGET_DEPTH_MS};
+#endif
 
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
     OpusResampler output_resampler_;
 
+    // Capture scratch buffers, only touched by the audio loop task
+    std::vector<int16_t> input_buffer_;
+    std::vector<int16_t> mic_channel_;
+    std::vector<int16_t> reference_channel_;
+    std::vector<int16_t> resampled_mic_;
+    std::vector<int16_t> resampled_reference_;
+    std::atomic<int64_t> input_resample_time_us_{0};
+    // Set by SelectCapturePipeline before the audio loop task starts
+    void (Application::*read_audio_)(std::vector<int16_t>& data, int samples) = nullptr;
+    // When the last ReadAudio returned, i.e. the capture time of the end of that chunk
+    std::atomic<int64_t> last_capture_end_us_{0};
+    // Capture time of the first sample buffered in the encoder, only used by the background task
+    int64_t encode_start_us_ = 0;
+    int encode_buffered_samples_ = 0;
+
+    LevelMeter capture_level_;
+    LevelMeter playback_level_;
+
     // 硬件访问应该通过Board接口，不在这里直接管理硬件对象
 
     void MainLoop();
     void OnAudioInput();
     void OnAudioOutput();
-    void ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples);
+    // Reads samples at 16000Hz through the capture pipeline selected for this codec
+    inline void ReadAudio(std::vector<int16_t>& data, int samples) { (this->*read_audio_)(data, samples); }
+    template <bool kResample, int kChannels>
+    void ReadAudioImpl(std::vector<int16_t>& data, int samples);
+    void SelectCapturePipeline();
+    void EncodeAudio(std::vector<int16_t>&& pcm, int64_t capture_time_us);
+    void OnAudioEncoded(std::vector<uint8_t>&& opus, uint32_t timestamp);
+    bool CanSuppressSilence() const;
+#if CONFIG_USE_OPUS_REPACKETIZER
+    void SendRepacketized(std::vector<uint8_t>&& packet);
+#endif
+    void SendAudio(AudioStreamPacket&& packet);
+#if !CONFIG_USE_UPLINK_WRITER
+    void SendPendingAudio();
+#endif
+    void AdaptUplinkPacketing(int64_t send_time_us, size_t backlog);
+    void FlushUplink();
     void ResetDecoder();
+    void FinishSpeaking();
+    void UpdateFlowControl(TtsFlowTransition flow);
+    void Preconnect(const char* reason);
+    void WakeOutput();
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckNewVersion();
     void ShowActivationCode();
     void OnClockTimer();
+#if CONFIG_USE_DEVICE_ENDPOINTING
+    void OnResponseTimeout();
+#endif
     void SetListeningMode(ListeningMode mode);
+    // stop_playback: a button press also cuts off what is playing, a spoken command does not
+    void ChangeOutputVolume(int delta, bool stop_playback);
+#if CONFIG_USE_LOCAL_COMMANDS
+    void HandleLocalCommand(int command_id);
+#endif
     void AudioLoop();
 };
 
@@ -5,6 +5,7 @@
 #include <esp_log.h>
 #include <cstring>
 #include <driver/i2s_common.h>
+#include <esp_timer.h>
 
 #define TAG "AudioCodec"
 
@@ -15,10 +16,57 @@ AudioCodec::~AudioCodec() {
 }
 
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
+    // Fade in after the output wakes up so the first samples do not click
+    if (fade_in_pending_.exchange(false)) {
+        // 5ms ramp
+        fade_in_samples_ = output_sample_rate_ * output_channels_ / 200;
+        fade_in_position_ = 0;
+    }
+    if (fade_in_position_ < fade_in_samples_) {
+        for (size_t i = 0; i < data.size() && fade_in_position_ < fade_in_samples_; i++, fade_in_position_++) {
+            data[i] = (int32_t)data[i] * fade_in_position_ / fade_in_samples_;
+        }
+    }
+
     Write(data.data(), data.size());
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    if (software_reference_) {
+        software_reference_->OnOutput(data.data(), data.size());
+    }
+#endif
+
+    auto wake_mode = output_wake_mode_.exchange(nullptr);
+    if (wake_mode != nullptr) {
+        ESP_LOGI(TAG, "First sample latency (%s): %lld us", wake_mode, esp_timer_get_time() - output_wake_time_us_);
+    }
+}
+
+void AudioCodec::StartOutputWake(const char* mode, int64_t start_time_us) {
+    output_wake_time_us_ = start_time_us;
+    output_wake_mode_ = mode;
+    fade_in_pending_ = true;
 }
 
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    if (software_reference_) {
+        // Capture mono and interleave the aligned reference as the second channel
+        int frames = data.size() / 2;
+        capture_buffer_.resize(frames);
+        reference_buffer_.resize(frames);
+        int samples = Read(capture_buffer_.data(), frames);
+        if (samples <= 0) {
+            return false;
+        }
+        software_reference_->Fill(capture_buffer_.data(), reference_buffer_.data(), samples);
+        for (int i = 0; i < samples; i++) {
+            data[i * 2] = capture_buffer_[i];
+            data[i * 2 + 1] = reference_buffer_[i];
+        }
+        return true;
+    }
+#endif
+
     int samples = Read(data.data(), data.size());
     if (samples > 0) {
         return true;
@@ -34,6 +82,16 @@ void AudioCodec::Start() {
         output_volume_ = 10;
     }
 
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    // 没有硬件回采的板子，用播放的数据做 AEC 参考通道
+    if (!input_reference_ && input_channels_ == 1 && GetDmaLatencyUs() > 0) {
+        software_reference_ = std::make_unique<SoftwareEchoReference>(output_sample_rate_, output_channels_,
+            input_sample_rate_, GetDmaLatencyUs());
+        input_reference_ = true;
+        input_channels_ = 2;
+    }
+#endif
+
     ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
     ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
 
@@ -63,5 +121,20 @@ void AudioCodec::EnableOutput(bool enable) {
         return;
     }
     output_enabled_ = enable;
+    output_muted_ = false;
+    if (enable && output_wake_mode_ == nullptr) {
+        StartOutputWake("cold", esp_timer_get_time());
+    }
     ESP_LOGI(TAG, "Set output enable to %s", enable ? "true" : "false");
 }
+
+void AudioCodec::SetOutputMute(bool mute) {
+    if (mute == output_muted_ || !output_enabled_) {
+        return;
+    }
+    output_muted_ = mute;
+    if (!mute) {
+        StartOutputWake("warm", esp_timer_get_time());
+    }
+    ESP_LOGI(TAG, "Set output mute to %s", mute ? "true" : "false");
+}
@@ -8,8 +8,13 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <memory>
+#include <atomic>
 
 #include "board.h"
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+#include "software_echo_reference.h"
+#endif
 
 class AudioCodec {
 public:
@@ -19,6 +24,8 @@ public:
     virtual void SetOutputVolume(int volume);
     virtual void EnableInput(bool enable);
     virtual void EnableOutput(bool enable);
+    // 保持编解码器打开，仅静音输出，恢复时无需重新上电
+    virtual void SetOutputMute(bool mute);
 
     void Start();
     void OutputData(std::vector<int16_t>& data);
@@ -33,6 +40,7 @@ public:
     inline int output_volume() const { return output_volume_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
+    inline bool output_muted() const { return output_muted_; }
 
 protected:
     i2s_chan_handle_t tx_handle_ = nullptr;
@@ -42,12 +50,33 @@ protected:
     bool input_reference_ = false;
     bool input_enabled_ = false;
     bool output_enabled_ = false;
+    // Set on the main loop, read by the audio loop before each output frame
+    std::atomic<bool> output_muted_{false};
     int input_sample_rate_ = 0;
     int output_sample_rate_ = 0;
     int input_channels_ = 1;
     int output_channels_ = 1;
     int output_volume_ = 70;
 
+    // First-sample latency measurement after the output wakes up. StartOutputWake is called from
+    // the main loop and the audio loop, the fade itself is only touched by OutputData
+    std::atomic<int64_t> output_wake_time_us_{0};
+    std::atomic<const char*> output_wake_mode_{nullptr};
+    std::atomic<bool> fade_in_pending_{false};
+    int fade_in_samples_ = 0;
+    int fade_in_position_ = 0;
+
+    void StartOutputWake(const char* mode, int64_t start_time_us);
+
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    // Software echo reference for codecs without a loopback channel
+    std::unique_ptr<SoftwareEchoReference> software_reference_;
+    std::vector<int16_t> capture_buffer_;
+    std::vector<int16_t> reference_buffer_;
+#endif
+    // TX DMA depth plus one RX DMA frame, 0 if the codec does not know it
+    virtual int64_t GetDmaLatencyUs() const { return 0; }
+
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
 };
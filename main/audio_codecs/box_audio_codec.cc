@@ -3,9 +3,15 @@
 #include <esp_log.h>
 #include <driver/i2c_master.h>
 #include <driver/i2s_tdm.h>
+#include <esp_timer.h>
 
 static const char TAG[] = "BoxAudioCodec";
 
+// ES8311 REG37[7:4] DAC_RAMPRATE, 0 disables the soft ramp. 1 steps 0.25dB every 4 LRCK,
+// a full mute or unmute takes about 64ms at 24kHz
+#define ES8311_DAC_RAMP_REG 0x37
+#define ES8311_DAC_RAMP_RATE 0x1
+
 BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int output_sample_rate,
     gpio_num_t mclk, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din,
     gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr, bool input_reference) {
@@ -16,18 +22,48 @@ BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int
     output_sample_rate_ = output_sample_rate;
 
     CreateDuplexChannels(mclk, bclk, ws, dout, din);
+    CreateCodecDevices(i2c_master_handle, pa_pin, es8311_addr, es7210_addr);
+}
 
+BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int output_sample_rate,
+    gpio_num_t mclk, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout,
+    gpio_num_t mic_mclk, gpio_num_t mic_bclk, gpio_num_t mic_ws, gpio_num_t din,
+    gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr, bool input_reference) {
+    duplex_ = false; // 是否双工
+    input_reference_ = input_reference; // 是否使用参考输入，实现回声消除
+    input_channels_ = input_reference_ ? 2 : 1; // 输入通道数
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+
+    CreateSimplexChannels(mclk, bclk, ws, dout, mic_mclk, mic_bclk, mic_ws, din);
+    CreateCodecDevices(i2c_master_handle, pa_pin, es8311_addr, es7210_addr);
+}
+
+void BoxAudioCodec::CreateCodecDevices(void* i2c_master_handle, gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr) {
     // Do initialize of related interface: data_if, ctrl_if and gpio_if
     audio_codec_i2s_cfg_t i2s_cfg = {
         .port = I2S_NUM_0,
-        .rx_handle = rx_handle_,
+        .rx_handle = duplex_ ? rx_handle_ : nullptr,
         .tx_handle = tx_handle_,
     };
-    data_if_ = audio_codec_new_i2s_data(&i2s_cfg);
-    if (data_if_ == NULL) {
+    out_data_if_ = audio_codec_new_i2s_data(&i2s_cfg);
+    if (out_data_if_ == NULL) {
         ESP_LOGE(TAG, "Failed to create I2S data interface");
         return;
     }
+    if (duplex_) {
+        in_data_if_ = out_data_if_;
+    } else {
+        // The microphones have their own controller, see CreateSimplexChannels
+        i2s_cfg.port = I2S_NUM_1;
+        i2s_cfg.rx_handle = rx_handle_;
+        i2s_cfg.tx_handle = nullptr;
+        in_data_if_ = audio_codec_new_i2s_data(&i2s_cfg);
+        if (in_data_if_ == NULL) {
+            ESP_LOGE(TAG, "Failed to create I2S input data interface");
+            return;
+        }
+    }
 
     // Output
     audio_codec_i2c_cfg_t i2c_cfg = {
@@ -65,7 +101,7 @@ BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int
     esp_codec_dev_cfg_t dev_cfg = {
         .dev_type = ESP_CODEC_DEV_TYPE_OUT,
         .codec_if = out_codec_if_,
-        .data_if = data_if_,
+        .data_if = out_data_if_,
     };
     output_dev_ = esp_codec_dev_new(&dev_cfg);
     if (output_dev_ == NULL) {
@@ -92,6 +128,7 @@ BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int
 
     dev_cfg.dev_type = ESP_CODEC_DEV_TYPE_IN;
     dev_cfg.codec_if = in_codec_if_;
+    dev_cfg.data_if = in_data_if_;
     input_dev_ = esp_codec_dev_new(&dev_cfg);
     if (input_dev_ == NULL) {
         ESP_LOGE(TAG, "Failed to create ES7210 input device");
@@ -112,10 +149,14 @@ BoxAudioCodec::~BoxAudioCodec() {
     audio_codec_delete_codec_if(out_codec_if_);
     audio_codec_delete_ctrl_if(out_ctrl_if_);
     audio_codec_delete_gpio_if(gpio_if_);
-    audio_codec_delete_data_if(data_if_);
+    if (in_data_if_ != out_data_if_) {
+        audio_codec_delete_data_if(in_data_if_);
+    }
+    audio_codec_delete_data_if(out_data_if_);
 }
 
 void BoxAudioCodec::CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din) {
+    // TX and RX share one I2S controller and its clock lines, use the simplex constructor for dual rates
     assert(input_sample_rate_ == output_sample_rate_);
 
     i2s_chan_config_t chan_cfg = {
@@ -203,6 +244,97 @@ void BoxAudioCodec::CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gpio_
     ESP_LOGI(TAG, "Duplex channels created");
 }
 
+void BoxAudioCodec::CreateSimplexChannels(gpio_num_t spk_mclk, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout,
+    gpio_num_t mic_mclk, gpio_num_t mic_bclk, gpio_num_t mic_ws, gpio_num_t mic_din) {
+    // Speaker on I2S0 at the output sample rate
+    i2s_chan_config_t chan_cfg = {
+        .id = I2S_NUM_0,
+        .role = I2S_ROLE_MASTER,
+        .dma_desc_num = 6,
+        .dma_frame_num = 240,
+        .auto_clear_after_cb = true,
+        .auto_clear_before_cb = false,
+        .intr_priority = 0,
+    };
+    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, &tx_handle_, nullptr));
+
+    i2s_std_config_t std_cfg = {
+        .clk_cfg = {
+            .sample_rate_hz = (uint32_t)output_sample_rate_,
+            .clk_src = I2S_CLK_SRC_DEFAULT,
+            .ext_clk_freq_hz = 0,
+            .mclk_multiple = I2S_MCLK_MULTIPLE_256
+        },
+        .slot_cfg = {
+            .data_bit_width = I2S_DATA_BIT_WIDTH_16BIT,
+            .slot_bit_width = I2S_SLOT_BIT_WIDTH_AUTO,
+            .slot_mode = I2S_SLOT_MODE_STEREO,
+            .slot_mask = I2S_STD_SLOT_BOTH,
+            .ws_width = I2S_DATA_BIT_WIDTH_16BIT,
+            .ws_pol = false,
+            .bit_shift = true,
+            .left_align = true,
+            .big_endian = false,
+            .bit_order_lsb = false
+        },
+        .gpio_cfg = {
+            .mclk = spk_mclk,
+            .bclk = spk_bclk,
+            .ws = spk_ws,
+            .dout = spk_dout,
+            .din = I2S_GPIO_UNUSED,
+            .invert_flags = {
+                .mclk_inv = false,
+                .bclk_inv = false,
+                .ws_inv = false
+            }
+        }
+    };
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
+
+    // Microphones on I2S1 with their own clocks at the input sample rate
+    chan_cfg.id = I2S_NUM_1;
+    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, nullptr, &rx_handle_));
+
+    i2s_tdm_config_t tdm_cfg = {
+        .clk_cfg = {
+            .sample_rate_hz = (uint32_t)input_sample_rate_,
+            .clk_src = I2S_CLK_SRC_DEFAULT,
+            .ext_clk_freq_hz = 0,
+            .mclk_multiple = I2S_MCLK_MULTIPLE_256,
+            .bclk_div = 8,
+        },
+        .slot_cfg = {
+            .data_bit_width = I2S_DATA_BIT_WIDTH_16BIT,
+            .slot_bit_width = I2S_SLOT_BIT_WIDTH_AUTO,
+            .slot_mode = I2S_SLOT_MODE_STEREO,
+            .slot_mask = i2s_tdm_slot_mask_t(I2S_TDM_SLOT0 | I2S_TDM_SLOT1 | I2S_TDM_SLOT2 | I2S_TDM_SLOT3),
+            .ws_width = I2S_TDM_AUTO_WS_WIDTH,
+            .ws_pol = false,
+            .bit_shift = true,
+            .left_align = false,
+            .big_endian = false,
+            .bit_order_lsb = false,
+            .skip_mask = false,
+            .total_slot = I2S_TDM_AUTO_SLOT_NUM
+        },
+        .gpio_cfg = {
+            .mclk = mic_mclk,
+            .bclk = mic_bclk,
+            .ws = mic_ws,
+            .dout = I2S_GPIO_UNUSED,
+            .din = mic_din,
+            .invert_flags = {
+                .mclk_inv = false,
+                .bclk_inv = false,
+                .ws_inv = false
+            }
+        }
+    };
+    ESP_ERROR_CHECK(i2s_channel_init_tdm_mode(rx_handle_, &tdm_cfg));
+    ESP_LOGI(TAG, "Simplex channels created, input %d Hz, output %d Hz", input_sample_rate_, output_sample_rate_);
+}
+
 void BoxAudioCodec::SetOutputVolume(int volume) {
     ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, volume));
     AudioCodec::SetOutputVolume(volume);
@@ -217,7 +349,7 @@ void BoxAudioCodec::EnableInput(bool enable) {
             .bits_per_sample = 16,
             .channel = 4,
             .channel_mask = ESP_CODEC_DEV_MAKE_CHANNEL_MASK(0),
-            .sample_rate = (uint32_t)output_sample_rate_,
+            .sample_rate = (uint32_t)input_sample_rate_,
             .mclk_multiple = 0,
         };
         if (input_reference_) {
@@ -235,6 +367,8 @@ void BoxAudioCodec::EnableOutput(bool enable) {
     if (enable == output_enabled_) {
         return;
     }
+    // Codec and PA bring-up is part of the cold start latency
+    int64_t start_time = esp_timer_get_time();
     if (enable) {
         // Play 16bit 1 channel
         esp_codec_dev_sample_info_t fs = {
@@ -246,10 +380,38 @@ void BoxAudioCodec::EnableOutput(bool enable) {
         };
         ESP_ERROR_CHECK(esp_codec_dev_open(output_dev_, &fs));
         ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, output_volume_));
+        // Opening the codec rewrites REG37
+        EnableDacSoftRamp();
     } else {
         ESP_ERROR_CHECK(esp_codec_dev_close(output_dev_));
     }
     AudioCodec::EnableOutput(enable);
+    if (enable) {
+        StartOutputWake("cold", start_time);
+    }
+}
+
+// With the soft ramp on, the DAC mute fades the output to and from silence instead of stepping
+// it, so the PA stays on across a mute without a pop
+void BoxAudioCodec::EnableDacSoftRamp() {
+    int value = 0;
+    if (out_codec_if_->get_reg(out_codec_if_, ES8311_DAC_RAMP_REG, &value) != ESP_CODEC_DEV_OK) {
+        ESP_LOGW(TAG, "Failed to read the DAC ramp register, mute is not ramped");
+        return;
+    }
+    value = (value & 0x0F) | (ES8311_DAC_RAMP_RATE << 4);
+    if (out_codec_if_->set_reg(out_codec_if_, ES8311_DAC_RAMP_REG, value) != ESP_CODEC_DEV_OK) {
+        ESP_LOGW(TAG, "Failed to enable the DAC soft ramp, mute is not ramped");
+    }
+}
+
+void BoxAudioCodec::SetOutputMute(bool mute) {
+    if (mute == output_muted_ || !output_enabled_) {
+        return;
+    }
+    // DAC soft mute, ramped by the codec. It stays powered and clocked so unmuting is immediate
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_out_mute(output_dev_, mute));
+    AudioCodec::SetOutputMute(mute);
 }
 
 int BoxAudioCodec::Read(int16_t* dest, int samples) {
@@ -8,7 +8,9 @@
 
 class BoxAudioCodec : public AudioCodec {
 private:
-    const audio_codec_data_if_t* data_if_ = nullptr;
+    // 双工时两者是同一个接口；单工时输入输出各用一个 I2S 端口
+    const audio_codec_data_if_t* out_data_if_ = nullptr;
+    const audio_codec_data_if_t* in_data_if_ = nullptr;
     const audio_codec_ctrl_if_t* out_ctrl_if_ = nullptr;
     const audio_codec_if_t* out_codec_if_ = nullptr;
     const audio_codec_ctrl_if_t* in_ctrl_if_ = nullptr;
@@ -19,6 +21,10 @@ private:
     esp_codec_dev_handle_t input_dev_ = nullptr;
 
     void CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din);
+    void CreateSimplexChannels(gpio_num_t spk_mclk, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout,
+        gpio_num_t mic_mclk, gpio_num_t mic_bclk, gpio_num_t mic_ws, gpio_num_t mic_din);
+    void CreateCodecDevices(void* i2c_master_handle, gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr);
+    void EnableDacSoftRamp();
 
     virtual int Read(int16_t* dest, int samples) override;
     virtual int Write(const int16_t* data, int samples) override;
@@ -27,11 +33,17 @@ public:
     BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int output_sample_rate,
         gpio_num_t mclk, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din,
         gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr, bool input_reference);
+    // ES8311 和 ES7210 使用独立的 I2S 时钟线时，输入输出可以工作在不同的采样率
+    BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int output_sample_rate,
+        gpio_num_t mclk, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout,
+        gpio_num_t mic_mclk, gpio_num_t mic_bclk, gpio_num_t mic_ws, gpio_num_t din,
+        gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr, bool input_reference);
     virtual ~BoxAudioCodec();
 
     virtual void SetOutputVolume(int volume) override;
     virtual void EnableInput(bool enable) override;
     virtual void EnableOutput(bool enable) override;
+    virtual void SetOutputMute(bool mute) override;
 };
 
 #endif // _BOX_AUDIO_CODEC_H
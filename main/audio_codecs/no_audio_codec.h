@@ -11,6 +11,9 @@ private:
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
+protected:
+    virtual int64_t GetDmaLatencyUs() const override;
+
 public:
     virtual ~NoAudioCodec();
 };
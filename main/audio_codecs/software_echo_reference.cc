@@ -0,0 +1,181 @@
+#include "software_echo_reference.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "SoftwareEchoReference"
+
+// 500ms of history covers the DMA latency with plenty of margin
+#define RING_DURATION_MS 500
+// Re-align the read position when it drifts more than 5ms from the clock
+#define RESYNC_THRESHOLD_MS 5
+// Delay estimation: 128ms window, search +-20ms, at most every 2 seconds
+#define ESTIMATE_WINDOW_MS 128
+#define ESTIMATE_MAX_LAG_MS 20
+#define ESTIMATE_INTERVAL_MS 2000
+
+SoftwareEchoReference::SoftwareEchoReference(int output_sample_rate, int output_channels, int input_sample_rate, int64_t latency_us)
+    : output_sample_rate_(output_sample_rate), output_channels_(output_channels),
+      input_sample_rate_(input_sample_rate), latency_us_(latency_us) {
+    ring_.resize(input_sample_rate_ * RING_DURATION_MS / 1000, 0);
+    mic_window_.reserve(input_sample_rate_ * ESTIMATE_WINDOW_MS / 1000);
+    ESP_LOGI(TAG, "Software echo reference, %d -> %d Hz, latency %lld us", output_sample_rate_, input_sample_rate_, latency_us_);
+}
+
+int64_t SoftwareEchoReference::TimeToIndex(int64_t time_us) const {
+    return time_us * input_sample_rate_ / 1000000;
+}
+
+void SoftwareEchoReference::OnOutput(const int16_t* data, int samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int frames = samples / output_channels_;
+
+    // A full TX DMA queue makes the write block, so the end of the block has just been queued.
+    // Keep the blocks contiguous unless the output ran dry in between
+    int64_t length = (int64_t)frames * input_sample_rate_ / output_sample_rate_;
+    int64_t start_index = TimeToIndex(esp_timer_get_time()) - length;
+    int64_t threshold = input_sample_rate_ * RESYNC_THRESHOLD_MS / 1000;
+    if (start_index <= write_index_ + threshold) {
+        start_index = write_index_;
+    } else {
+        // Silence between the blocks
+        for (int64_t i = std::max(write_index_, start_index - (int64_t)ring_.size()); i < start_index; i++) {
+            ring_[i % ring_.size()] = 0;
+        }
+        resample_phase_ = 0;
+        last_output_sample_ = 0;
+    }
+    write_index_ = start_index;
+
+    // Linear resampling from the output rate to the input rate, downmixed to mono
+    double step = (double)output_sample_rate_ / input_sample_rate_;
+    auto sample_at = [&](int frame) -> int32_t {
+        if (frame < 0) {
+            return last_output_sample_;
+        }
+        int32_t sum = 0;
+        for (int c = 0; c < output_channels_; c++) {
+            sum += data[frame * output_channels_ + c];
+        }
+        return sum / output_channels_;
+    };
+    double position = resample_phase_;
+    while (position < frames - 1) {
+        int frame = (int)std::floor(position);
+        double fraction = position - frame;
+        int32_t a = sample_at(frame);
+        int32_t b = sample_at(frame + 1);
+        ring_[write_index_ % ring_.size()] = (int16_t)(a + (b - a) * fraction);
+        write_index_++;
+        position += step;
+    }
+    resample_phase_ = position - frames;
+    if (frames > 0) {
+        last_output_sample_ = sample_at(frames - 1);
+    }
+}
+
+void SoftwareEchoReference::ReadRing(int64_t index, int16_t* dest, int samples) const {
+    int64_t oldest = write_index_ - (int64_t)ring_.size();
+    for (int i = 0; i < samples; i++, index++) {
+        dest[i] = (index >= write_index_ || index < oldest || index < 0) ? 0 : ring_[index % ring_.size()];
+    }
+}
+
+void SoftwareEchoReference::Fill(const int16_t* mic, int16_t* reference, int samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // The captured block ends now and holds what was queued latency_us_ earlier. Follow the sample
+    // count to keep the alignment stable from block to block, and only fall back to the clock if
+    // the two drift apart
+    int64_t expected = TimeToIndex(esp_timer_get_time() - latency_us_) - samples;
+    int64_t threshold = input_sample_rate_ * RESYNC_THRESHOLD_MS / 1000;
+    if (read_index_ < 0 || std::abs(read_index_ - expected) > threshold) {
+        read_index_ = expected;
+        // The window collected so far no longer lines up with the ring
+        mic_window_.clear();
+    }
+    int64_t index = read_index_;
+    ReadRing(index, reference, samples);
+    read_index_ += samples;
+    UpdateDelayEstimate(index, mic, samples);
+}
+
+// Refine the DMA latency from the echo itself, while something loud enough is playing.
+// index is the ring position the mic block was aligned with
+void SoftwareEchoReference::UpdateDelayEstimate(int64_t index, const int16_t* mic, int samples) {
+    int window = input_sample_rate_ * ESTIMATE_WINDOW_MS / 1000;
+    int max_lag = input_sample_rate_ * ESTIMATE_MAX_LAG_MS / 1000;
+    if (index - last_estimate_index_ < input_sample_rate_ * ESTIMATE_INTERVAL_MS / 1000) {
+        return;
+    }
+    if (mic_window_.empty()) {
+        window_index_ = index;
+    }
+    int count = std::min(samples, window - (int)mic_window_.size());
+    mic_window_.insert(mic_window_.end(), mic, mic + count);
+    if ((int)mic_window_.size() < window || window_index_ + window + max_lag > write_index_) {
+        if ((int)mic_window_.size() >= window) {
+            // The playback stopped, try again later
+            mic_window_.clear();
+        }
+        return;
+    }
+
+    std::vector<int16_t> reference(window + 2 * max_lag);
+    ReadRing(window_index_ - max_lag, reference.data(), reference.size());
+    int lag = EstimateDelay(reference.data(), mic_window_.data(), window, max_lag);
+    mic_window_.clear();
+    last_estimate_index_ = index;
+    if (lag == INT32_MIN) {
+        return;
+    }
+
+    // Only move when two estimates agree, a single one may lock onto a periodic signal.
+    // A positive lag means the echo arrives late, so the reference is read further back. The
+    // read position is taken from the clock again on the next block, with the new latency
+    if (lag != 0 && lag == last_lag_) {
+        latency_us_ += (int64_t)lag * 1000000 / input_sample_rate_;
+        read_index_ = -1;
+        ESP_LOGI(TAG, "Echo delay adjusted by %d samples, latency %lld us", lag, latency_us_);
+        last_lag_ = 0;
+    } else {
+        last_lag_ = lag;
+    }
+}
+
+int SoftwareEchoReference::EstimateDelay(const int16_t* reference, const int16_t* mic, int samples, int max_lag) {
+    int64_t mic_energy = 0;
+    for (int i = 0; i < samples; i++) {
+        mic_energy += (int32_t)mic[i] * mic[i];
+    }
+    if (mic_energy == 0) {
+        return INT32_MIN;
+    }
+
+    // reference[max_lag + i] is aligned with mic[i], a positive lag means the echo arrives late
+    double best = 0;
+    int best_lag = INT32_MIN;
+    for (int lag = -max_lag; lag <= max_lag; lag++) {
+        const int16_t* ref = reference + max_lag - lag;
+        int64_t correlation = 0;
+        int64_t ref_energy = 0;
+        for (int i = 0; i < samples; i++) {
+            correlation += (int32_t)ref[i] * mic[i];
+            ref_energy += (int32_t)ref[i] * ref[i];
+        }
+        if (ref_energy == 0 || correlation <= 0) {
+            continue;
+        }
+        double score = (double)correlation / std::sqrt((double)ref_energy * mic_energy);
+        if (score > best) {
+            best = score;
+            best_lag = lag;
+        }
+    }
+    // The echo is mixed with speech and noise, but it still has to stand out
+    return best > 0.3 ? best_lag : INT32_MIN;
+}
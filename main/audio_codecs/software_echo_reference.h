@@ -0,0 +1,54 @@
+#ifndef _SOFTWARE_ECHO_REFERENCE_H
+#define _SOFTWARE_ECHO_REFERENCE_H
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+// 软件回采：没有硬件回采通道的板子，把送往扬声器的 PCM 按 DMA 延迟对齐后作为 AEC 的参考通道
+class SoftwareEchoReference {
+public:
+    // latency_us: time from a sample being queued to the output DMA until the same moment shows up in the
+    // captured data, i.e. the TX DMA depth plus one RX DMA frame
+    SoftwareEchoReference(int output_sample_rate, int output_channels, int input_sample_rate, int64_t latency_us);
+
+    // Called after a block has been queued to the output DMA
+    void OnOutput(const int16_t* data, int samples);
+    // Fill the reference aligned with a block that has just been captured
+    void Fill(const int16_t* mic, int16_t* reference, int samples);
+
+    inline int64_t latency_us() const { return latency_us_; }
+
+    // Lag in samples of the echo in mic relative to reference, searched in [-max_lag, max_lag].
+    // reference must hold max_lag extra samples on both sides of the mic window.
+    // Returns INT32_MIN if the correlation is too weak to tell
+    static int EstimateDelay(const int16_t* reference, const int16_t* mic, int samples, int max_lag);
+
+private:
+    std::mutex mutex_;
+    int output_sample_rate_;
+    int output_channels_;
+    int input_sample_rate_;
+    int64_t latency_us_;
+
+    // Reference history at the input rate, indexed by the time the sample is queued to the output DMA.
+    // Fill reads it latency_us_ behind the capture time, that is the only place the latency applies
+    std::vector<int16_t> ring_;
+    int64_t write_index_ = 0;
+    int64_t read_index_ = -1;
+    // Fractional position of the linear resampler, in output samples
+    double resample_phase_ = 0;
+    int16_t last_output_sample_ = 0;
+
+    // Delay estimation window
+    std::vector<int16_t> mic_window_;
+    int64_t window_index_ = 0;
+    int last_lag_ = 0;
+    int64_t last_estimate_index_ = 0;
+
+    int64_t TimeToIndex(int64_t time_us) const;
+    void ReadRing(int64_t index, int16_t* dest, int samples) const;
+    void UpdateDelayEstimate(int64_t index, const int16_t* mic, int samples);
+};
+
+#endif // _SOFTWARE_ECHO_REFERENCE_H
@@ -73,6 +73,8 @@ void AudioProcessor::Feed(const std::vector<int16_t>& data) {
 }
 
 void AudioProcessor::Start() {
+    // Report the first speech segment of every session to the VAD listener
+    is_speaking_ = false;
     xEventGroupSetBits(event_group_, PROCESSOR_RUNNING);
 }
 
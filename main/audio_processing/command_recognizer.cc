@@ -0,0 +1,218 @@
+#include "command_recognizer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_mn_models.h>
+#include <esp_mn_speech_commands.h>
+#include <model_path.h>
+
+#include <algorithm>
+
+#define RECOGNIZER_RUNNING 0x01
+// Keep at most this many chunks if the recognizer falls behind, older audio is useless for a command
+#define MAX_PENDING_CHUNKS 8
+// Longest time a command may take to say
+#define COMMAND_TIMEOUT_MS 3000
+// Echo tail the AEC models, in AEC frames of 16ms, the AFE uses the same length
+#define AEC_FILTER_LENGTH 4
+// MultiNet detection needs 8KB like in the ESP-SR examples, the AEC runs on this stack too
+#define COMMAND_RECOGNIZER_STACK_SIZE (4096 * 3)
+
+static const char* TAG = "CommandRecognizer";
+
+CommandRecognizer::CommandRecognizer() {
+    event_group_ = xEventGroupCreate();
+}
+
+CommandRecognizer::~CommandRecognizer() {
+    if (model_data_ != nullptr) {
+        multinet_->destroy(model_data_);
+    }
+    if (aec_ != nullptr) {
+        aec_destroy(aec_);
+        heap_caps_free(aec_mic_);
+        heap_caps_free(aec_reference_);
+        heap_caps_free(aec_output_);
+    }
+    vEventGroupDelete(event_group_);
+}
+
+bool CommandRecognizer::Initialize(bool input_reference) {
+    srmodel_list_t* models = esp_srmodel_init("model");
+    char* mn_name = esp_srmodel_filter(models, ESP_MN_PREFIX, ESP_MN_CHINESE);
+    if (mn_name == nullptr) {
+        mn_name = esp_srmodel_filter(models, ESP_MN_PREFIX, NULL);
+    }
+    if (mn_name == nullptr) {
+        ESP_LOGE(TAG, "No MultiNet model found in the model partition");
+        return false;
+    }
+
+    multinet_ = esp_mn_handle_from_name(mn_name);
+    model_data_ = multinet_->create(mn_name, COMMAND_TIMEOUT_MS);
+    chunk_size_ = multinet_->get_samp_chunksize(model_data_);
+    esp_mn_commands_alloc(multinet_, model_data_);
+    esp_mn_commands_clear();
+    ESP_LOGI(TAG, "Model: %s, chunk size: %d", mn_name, chunk_size_);
+
+    if (input_reference) {
+        aec_ = aec_create(16000, AEC_FILTER_LENGTH, 1, AEC_MODE_SR_LOW_COST);
+        if (aec_ == nullptr) {
+            ESP_LOGW(TAG, "Failed to create AEC, commands are not listened for while speaking");
+        } else {
+            // The AEC works on 16 byte aligned frames of its own size
+            aec_chunk_size_ = aec_get_chunksize(aec_);
+            aec_mic_ = (int16_t*)heap_caps_aligned_alloc(16, aec_chunk_size_ * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+            aec_reference_ = (int16_t*)heap_caps_aligned_alloc(16, aec_chunk_size_ * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+            aec_output_ = (int16_t*)heap_caps_aligned_alloc(16, aec_chunk_size_ * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+            ESP_LOGI(TAG, "AEC chunk size: %d", aec_chunk_size_);
+        }
+    }
+
+    xTaskCreate([](void* arg) {
+        auto this_ = (CommandRecognizer*)arg;
+        this_->CommandRecognizerTask();
+        vTaskDelete(NULL);
+    }, "command_recognizer", COMMAND_RECOGNIZER_STACK_SIZE, this, 2, NULL);
+    return true;
+}
+
+void CommandRecognizer::AddCommand(int command_id, const std::string& phrases) {
+    size_t start = 0;
+    while (start < phrases.size()) {
+        size_t end = phrases.find(';', start);
+        if (end == std::string::npos) {
+            end = phrases.size();
+        }
+        auto phrase = phrases.substr(start, end - start);
+        if (!phrase.empty()) {
+            if (esp_mn_commands_add(command_id, phrase.c_str()) != ESP_OK) {
+                ESP_LOGW(TAG, "Failed to add command %d: %s", command_id, phrase.c_str());
+            }
+        }
+        start = end + 1;
+    }
+}
+
+void CommandRecognizer::UpdateCommands() {
+    esp_mn_error_t* errors = esp_mn_commands_update();
+    if (errors != nullptr && errors->num > 0) {
+        for (int i = 0; i < errors->num; i++) {
+            ESP_LOGW(TAG, "Invalid phrase for command %d: %s", errors->phrases[i]->command_id, errors->phrases[i]->string);
+        }
+    }
+}
+
+void CommandRecognizer::OnCommand(std::function<void(int command_id)> callback) {
+    command_callback_ = callback;
+}
+
+void CommandRecognizer::Start() {
+    if (model_data_ == nullptr) {
+        return;
+    }
+    xEventGroupSetBits(event_group_, RECOGNIZER_RUNNING);
+}
+
+void CommandRecognizer::Stop() {
+    xEventGroupClearBits(event_group_, RECOGNIZER_RUNNING);
+    std::lock_guard<std::mutex> lock(mutex_);
+    chunks_.clear();
+    // The task owns the AEC remainders and the model, it drops them before the next chunk
+    reset_pending_ = true;
+}
+
+bool CommandRecognizer::IsRunning() {
+    return xEventGroupGetBits(event_group_) & RECOGNIZER_RUNNING;
+}
+
+size_t CommandRecognizer::GetFeedSize() {
+    return chunk_size_;
+}
+
+void CommandRecognizer::Feed(const std::vector<int16_t>& data, int channels) {
+    // With AEC the chunk holds the microphone samples followed by the reference samples
+    size_t frames = data.size() / channels;
+    bool with_reference = aec_ != nullptr && channels > 1;
+    std::vector<int16_t> chunk(with_reference ? frames * 2 : frames);
+    for (size_t i = 0, j = 0; i < frames; ++i, j += channels) {
+        chunk[i] = data[j];
+        if (with_reference) {
+            chunk[frames + i] = data[j + channels - 1];
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    chunks_.emplace_back(std::move(chunk));
+    while (chunks_.size() > MAX_PENDING_CHUNKS) {
+        chunks_.pop_front();
+    }
+    cv_.notify_one();
+}
+
+void CommandRecognizer::CommandRecognizerTask() {
+    while (true) {
+        xEventGroupWaitBits(event_group_, RECOGNIZER_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
+
+        std::vector<int16_t> chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return !chunks_.empty(); });
+            chunk = std::move(chunks_.front());
+            chunks_.pop_front();
+        }
+        if (reset_pending_.exchange(false)) {
+            // A command half said before the stop must not complete with audio from after the start
+            pending_mic_.clear();
+            pending_reference_.clear();
+            cleaned_.clear();
+            multinet_->clean(model_data_);
+        }
+        if (aec_ != nullptr) {
+            CancelEcho(chunk);
+        } else if (chunk.size() == (size_t)chunk_size_) {
+            Detect(chunk.data());
+        }
+    }
+}
+
+void CommandRecognizer::CancelEcho(const std::vector<int16_t>& chunk) {
+    size_t frames = chunk.size() / 2;
+    pending_mic_.insert(pending_mic_.end(), chunk.begin(), chunk.begin() + frames);
+    pending_reference_.insert(pending_reference_.end(), chunk.begin() + frames, chunk.end());
+
+    // The AEC and MultiNet frame sizes differ, so both sides keep their remainder for the next chunk
+    size_t offset = 0;
+    while (pending_mic_.size() - offset >= (size_t)aec_chunk_size_) {
+        std::copy_n(pending_mic_.begin() + offset, aec_chunk_size_, aec_mic_);
+        std::copy_n(pending_reference_.begin() + offset, aec_chunk_size_, aec_reference_);
+        aec_process(aec_, aec_mic_, aec_reference_, aec_output_);
+        cleaned_.insert(cleaned_.end(), aec_output_, aec_output_ + aec_chunk_size_);
+        offset += aec_chunk_size_;
+    }
+    pending_mic_.erase(pending_mic_.begin(), pending_mic_.begin() + offset);
+    pending_reference_.erase(pending_reference_.begin(), pending_reference_.begin() + offset);
+
+    offset = 0;
+    while (cleaned_.size() - offset >= (size_t)chunk_size_) {
+        Detect(cleaned_.data() + offset);
+        offset += chunk_size_;
+    }
+    cleaned_.erase(cleaned_.begin(), cleaned_.begin() + offset);
+}
+
+void CommandRecognizer::Detect(int16_t* chunk) {
+    esp_mn_state_t state = multinet_->detect(model_data_, chunk);
+    if (state == ESP_MN_STATE_DETECTED) {
+        esp_mn_results_t* results = multinet_->get_results(model_data_);
+        if (results->num > 0) {
+            ESP_LOGI(TAG, "Command %d detected, prob: %.2f", results->command_id[0], results->prob[0]);
+            if (command_callback_) {
+                command_callback_(results->command_id[0]);
+            }
+        }
+        multinet_->clean(model_data_);
+    } else if (state == ESP_MN_STATE_TIMEOUT) {
+        multinet_->clean(model_data_);
+    }
+}
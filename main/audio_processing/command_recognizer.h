@@ -0,0 +1,71 @@
+#ifndef COMMAND_RECOGNIZER_H
+#define COMMAND_RECOGNIZER_H
+
+#include <esp_mn_iface.h>
+#include <esp_aec.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <list>
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+// 本地命令词识别：用 model 分区里的 MultiNet 识别音量、停止等短命令，不需要联网
+class CommandRecognizer {
+public:
+    CommandRecognizer();
+    ~CommandRecognizer();
+
+    // Returns false if the model partition has no MultiNet model.
+    // input_reference: the last input channel carries the playback, the microphone then goes through AEC first
+    bool Initialize(bool input_reference);
+    // phrases: one or more phrases separated by ';', in the format the MultiNet model expects
+    void AddCommand(int command_id, const std::string& phrases);
+    // Must be called after the commands are added
+    void UpdateCommands();
+    // Called from the recognizer task
+    void OnCommand(std::function<void(int command_id)> callback);
+    void Start();
+    void Stop();
+    bool IsRunning();
+    // Without AEC the model hears the device's own playback, so it should not listen while speaking
+    inline bool cancels_echo() const { return aec_ != nullptr; }
+    // Samples per channel to read for one Feed call
+    size_t GetFeedSize();
+    // 16000Hz, the first channel is the microphone and the last one the reference if there is one
+    void Feed(const std::vector<int16_t>& data, int channels);
+
+private:
+    EventGroupHandle_t event_group_ = nullptr;
+    esp_mn_iface_t* multinet_ = nullptr;
+    model_iface_data_t* model_data_ = nullptr;
+    int chunk_size_ = 0;
+    std::function<void(int command_id)> command_callback_;
+
+    // Only used by the recognizer task
+    aec_handle_t* aec_ = nullptr;
+    int aec_chunk_size_ = 0;
+    int16_t* aec_mic_ = nullptr;
+    int16_t* aec_reference_ = nullptr;
+    int16_t* aec_output_ = nullptr;
+    std::vector<int16_t> pending_mic_;
+    std::vector<int16_t> pending_reference_;
+    std::vector<int16_t> cleaned_;
+    std::atomic<bool> reset_pending_{false};
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::list<std::vector<int16_t>> chunks_;
+
+    void CommandRecognizerTask();
+    void Detect(int16_t* chunk);
+    void CancelEcho(const std::vector<int16_t>& chunk);
+};
+
+#endif // COMMAND_RECOGNIZER_H
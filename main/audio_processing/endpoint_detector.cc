@@ -0,0 +1,65 @@
+#include "endpoint_detector.h"
+
+#include <esp_log.h>
+
+static const char* TAG = "EndpointDetector";
+
+EndpointDetector::EndpointDetector(int sample_rate) : sample_rate_(sample_rate) {
+}
+
+void EndpointDetector::Configure(int silence_ms, int min_speech_ms, int energy_threshold) {
+    silence_samples_limit_ = silence_ms * sample_rate_ / 1000;
+    min_speech_samples_ = min_speech_ms * sample_rate_ / 1000;
+    // Compare mean square energy, so keep the threshold squared
+    energy_threshold_ = (int64_t)energy_threshold * energy_threshold;
+    ESP_LOGI(TAG, "Configured silence: %dms, min speech: %dms, energy threshold: %d",
+        silence_ms, min_speech_ms, energy_threshold);
+}
+
+void EndpointDetector::Reset() {
+    vad_speaking_ = false;
+    triggered_ = false;
+    // The counters belong to the task that runs Process
+    reset_pending_ = true;
+}
+
+void EndpointDetector::SetVadState(bool speaking) {
+    vad_speaking_ = speaking;
+}
+
+bool EndpointDetector::Process(const std::vector<int16_t>& pcm) {
+    if (reset_pending_.exchange(false)) {
+        speech_samples_ = 0;
+        silence_samples_ = 0;
+    }
+    if (triggered_ || pcm.empty()) {
+        return false;
+    }
+
+    int64_t sum = 0;
+    for (auto sample : pcm) {
+        sum += (int32_t)sample * sample;
+    }
+    bool loud = sum / (int64_t)pcm.size() >= energy_threshold_;
+
+    // VAD hangover can keep reporting speech for a while, so a quiet frame also counts as silence
+    if (vad_speaking_ && loud) {
+        speech_samples_ += pcm.size();
+        silence_samples_ = 0;
+        return false;
+    }
+
+    // Do not count the silence before the user starts talking
+    if (speech_samples_ < min_speech_samples_) {
+        return false;
+    }
+
+    silence_samples_ += pcm.size();
+    if (silence_samples_ >= silence_samples_limit_) {
+        triggered_ = true;
+        ESP_LOGI(TAG, "End of speech detected, speech: %dms, trailing silence: %dms",
+            speech_samples_.load() * 1000 / sample_rate_, silence_samples_.load() * 1000 / sample_rate_);
+        return true;
+    }
+    return false;
+}
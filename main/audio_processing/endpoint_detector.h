@@ -0,0 +1,40 @@
+#ifndef ENDPOINT_DETECTOR_H
+#define ENDPOINT_DETECTOR_H
+
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+
+// 端点检测：结合 AFE 的 VAD 状态与帧能量，在用户说完话后的静音超过阈值时触发
+class EndpointDetector {
+public:
+    EndpointDetector(int sample_rate = 16000);
+
+    void Configure(int silence_ms, int min_speech_ms, int energy_threshold);
+    // 可在任意任务调用，计数在下一次 Process 时清零
+    void Reset();
+    void SetVadState(bool speaking);
+    // 返回 true 表示本帧判定为语音结束（只触发一次，直到下次 Reset）
+    bool Process(const std::vector<int16_t>& pcm);
+
+    inline bool triggered() const { return triggered_; }
+    // 主循环读取；Reset 之后、下一次 Process 之前返回 0
+    inline int speech_ms() const { return reset_pending_ ? 0 : speech_samples_ * 1000 / sample_rate_; }
+
+private:
+    int sample_rate_;
+    int silence_samples_limit_ = 0;
+    int min_speech_samples_ = 0;
+    int64_t energy_threshold_ = 0;
+
+    // Process 与 SetVadState 在音频处理任务中调用，Reset、triggered() 与 speech_ms() 来自主循环。
+    // 计数只由 Process 写入
+    std::atomic<bool> vad_speaking_{false};
+    std::atomic<bool> triggered_{false};
+    std::atomic<bool> reset_pending_{false};
+    std::atomic<int> speech_samples_{0};
+    std::atomic<int> silence_samples_{0};
+};
+
+#endif // ENDPOINT_DETECTOR_H
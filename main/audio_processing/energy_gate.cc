@@ -0,0 +1,118 @@
+#include "energy_gate.h"
+
+#include <esp_log.h>
+#include <cmath>
+
+static const char* TAG = "EnergyGate";
+
+// Mean square of a quiet room through the AFE input, also the lowest floor we track
+#define MIN_NOISE_FLOOR 64
+// Noise only has a high zero crossing rate at low energy, voiced speech stays well below this
+#define MAX_ZERO_CROSSING_PERCENT 40
+// The zero crossing check only applies up to this many times the opening threshold (about 6dB),
+// louder sounds such as fricatives open the gate whatever their zero crossing rate
+#define ZERO_CROSSING_ENERGY_MARGIN 4
+// How fast the floor follows a louder input, as a fraction of the difference per chunk. While the gate
+// is open this is mostly speech, the floor still creeps up so that a lasting louder noise closes it again
+#define NOISE_FLOOR_RISE_CLOSED 64
+#define NOISE_FLOOR_RISE_OPEN 1024
+
+EnergyGate::EnergyGate(int sample_rate) : sample_rate_(sample_rate) {
+}
+
+void EnergyGate::Configure(int threshold_db, int lookback_ms, int hangover_ms) {
+    // The ratio is kept in Q8 so that the per-chunk comparison stays in integers
+    ratio_q8_ = (int64_t)(std::pow(10.0, threshold_db / 10.0) * 256);
+    lookback_samples_ = lookback_ms * sample_rate_ / 1000;
+    hangover_samples_ = hangover_ms * sample_rate_ / 1000;
+    ESP_LOGI(TAG, "Configured threshold: %ddB, look-back: %dms, hangover: %dms", threshold_db, lookback_ms, hangover_ms);
+    Reset();
+}
+
+void EnergyGate::Reset() {
+    // Process owns the state, it clears it when it sees the flag
+    open_ = false;
+    reset_pending_ = true;
+}
+
+void EnergyGate::Process(std::vector<int16_t>&& chunk, int channels, std::function<void(const std::vector<int16_t>&)> feed) {
+    if (reset_pending_.exchange(false)) {
+        open_ = false;
+        quiet_samples_ = 0;
+        noise_floor_ = MIN_NOISE_FLOOR;
+        lookback_.clear();
+        lookback_size_ = 0;
+    }
+
+    int frames = chunk.size() / channels;
+    if (frames == 0) {
+        return;
+    }
+
+    int64_t sum = 0;
+    int zero_crossings = 0;
+    int16_t previous = chunk[0];
+    for (int i = 0; i < frames; i++) {
+        int16_t sample = chunk[i * channels];
+        sum += (int32_t)sample * sample;
+        if ((sample ^ previous) < 0) {
+            zero_crossings++;
+        }
+        previous = sample;
+    }
+    int64_t energy = sum / frames;
+    int64_t threshold_q8 = noise_floor_ * ratio_q8_;
+    bool hiss = zero_crossings * 100 >= frames * MAX_ZERO_CROSSING_PERCENT;
+    bool loud = energy * 256 > threshold_q8 && (!hiss || energy * 256 > threshold_q8 * ZERO_CROSSING_ENERGY_MARGIN);
+
+    chunks_++;
+    UpdateNoiseFloor(energy, open_ ? NOISE_FLOOR_RISE_OPEN : NOISE_FLOOR_RISE_CLOSED);
+    if (open_) {
+        open_chunks_++;
+        quiet_samples_ = loud ? 0 : quiet_samples_ + frames;
+        feed(chunk);
+        if (quiet_samples_ >= hangover_samples_) {
+            open_ = false;
+        }
+        return;
+    }
+
+    if (loud) {
+        // Feed the look-back first so that the start of the wake word is not clipped
+        open_ = true;
+        open_chunks_++;
+        quiet_samples_ = 0;
+        for (auto& previous_chunk : lookback_) {
+            feed(previous_chunk);
+        }
+        lookback_.clear();
+        lookback_size_ = 0;
+        feed(chunk);
+        return;
+    }
+
+    lookback_size_ += frames;
+    lookback_.emplace_back(std::move(chunk));
+    while (!lookback_.empty() && lookback_size_ - (int)(lookback_.front().size() / channels) >= lookback_samples_) {
+        lookback_size_ -= lookback_.front().size() / channels;
+        lookback_.pop_front();
+    }
+}
+
+// Follow the floor down quickly and up slowly, so speech does not raise it
+void EnergyGate::UpdateNoiseFloor(int64_t energy, int rise_divisor) {
+    if (energy < noise_floor_) {
+        noise_floor_ -= (noise_floor_ - energy) / 4;
+    } else {
+        noise_floor_ += (energy - noise_floor_) / rise_divisor;
+    }
+    if (noise_floor_ < MIN_NOISE_FLOOR) {
+        noise_floor_ = MIN_NOISE_FLOOR;
+    }
+}
+
+int EnergyGate::TakeOpenPercent() {
+    uint32_t chunks = chunks_.exchange(0);
+    uint32_t open_chunks = open_chunks_.exchange(0);
+    return chunks > 0 ? open_chunks * 100 / chunks : 0;
+}
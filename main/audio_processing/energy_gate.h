@@ -0,0 +1,44 @@
+#ifndef ENERGY_GATE_H
+#define ENERGY_GATE_H
+
+#include <vector>
+#include <list>
+#include <cstdint>
+#include <functional>
+#include <atomic>
+
+// 待机时的低功耗能量门：只有声音明显高于底噪时才把数据送进唤醒词/命令词模型，并补上之前的一小段数据
+class EnergyGate {
+public:
+    EnergyGate(int sample_rate = 16000);
+
+    void Configure(int threshold_db, int lookback_ms, int hangover_ms);
+    // May be called from any task, the gate closes before the next chunk is processed
+    void Reset();
+    // channels: the energy is measured on the first (microphone) channel only.
+    // Calls feed for every chunk that should go to the AFE, including the look-back on opening
+    void Process(std::vector<int16_t>&& chunk, int channels, std::function<void(const std::vector<int16_t>&)> feed);
+
+    inline bool is_open() const { return open_; }
+    // Fraction of the chunks that passed the gate since the last call, in percent
+    int TakeOpenPercent();
+
+private:
+    int sample_rate_;
+    int64_t ratio_q8_ = 0;
+    int lookback_samples_ = 0;
+    int hangover_samples_ = 0;
+
+    std::atomic<bool> open_{false};
+    std::atomic<bool> reset_pending_{false};
+    int quiet_samples_ = 0;
+    int64_t noise_floor_ = 0;
+    std::list<std::vector<int16_t>> lookback_;
+    int lookback_size_ = 0;
+    std::atomic<uint32_t> chunks_{0};
+    std::atomic<uint32_t> open_chunks_{0};
+
+    void UpdateNoiseFloor(int64_t energy, int rise_divisor);
+};
+
+#endif // ENERGY_GATE_H
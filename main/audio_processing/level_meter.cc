@@ -0,0 +1,97 @@
+#include "level_meter.h"
+
+#include <cmath>
+#include <cstdlib>
+
+// Samples at or above this magnitude count as clipped, the codecs saturate a little below full scale
+#define CLIPPING_LEVEL 32700
+
+static float ToDbfs(uint16_t value) {
+    if (value == 0) {
+        return -96.0f;
+    }
+    return 20.0f * log10f(value / 32768.0f);
+}
+
+float AudioLevel::rms_dbfs() const {
+    return ToDbfs(rms);
+}
+
+float AudioLevel::peak_dbfs() const {
+    return ToDbfs(peak);
+}
+
+static uint32_t IntegerSqrt(uint64_t value) {
+    uint64_t result = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
+
+void LevelMeter::Process(const int16_t* data, size_t samples, int channels) {
+    size_t frames = samples / channels;
+    if (frames == 0) {
+        return;
+    }
+
+    // Four independent accumulators keep the multiply-accumulate pipeline busy
+    int64_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    int32_t peak = 0;
+    uint32_t clipped = 0;
+    size_t i = 0;
+    auto measure = [&](int32_t sample, int64_t& sum) {
+        int32_t magnitude = std::abs(sample);
+        sum += sample * sample;
+        peak = magnitude > peak ? magnitude : peak;
+        clipped += magnitude >= CLIPPING_LEVEL;
+    };
+    if (channels == 1) {
+        for (; i + 4 <= frames; i += 4) {
+            measure(data[i], sum0);
+            measure(data[i + 1], sum1);
+            measure(data[i + 2], sum2);
+            measure(data[i + 3], sum3);
+        }
+        for (; i < frames; i++) {
+            measure(data[i], sum0);
+        }
+    } else {
+        for (; i < frames; i++) {
+            measure(data[i * channels], sum0);
+        }
+    }
+
+    uint32_t rms = IntegerSqrt((uint64_t)(sum0 + sum1 + sum2 + sum3) / frames);
+    if (peak > 32767) {
+        peak = 32767;
+    }
+    level_.store((rms > 0xFFFF ? 0xFFFF : rms) | ((uint32_t)peak << 16) | (clipped > 0 ? 0x80000000 : 0),
+        std::memory_order_relaxed);
+    if (clipped > 0) {
+        clipped_samples_.fetch_add(clipped, std::memory_order_relaxed);
+    }
+}
+
+AudioLevel LevelMeter::GetLevel() const {
+    uint32_t value = level_.load(std::memory_order_relaxed);
+    AudioLevel level;
+    level.rms = value & 0xFFFF;
+    level.peak = (value >> 16) & 0x7FFF;
+    level.clipping = (value & 0x80000000) != 0;
+    return level;
+}
+
+uint32_t LevelMeter::TakeClippedSamples() {
+    return clipped_samples_.exchange(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,34 @@
+#ifndef LEVEL_METER_H
+#define LEVEL_METER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+struct AudioLevel {
+    uint16_t rms = 0;
+    uint16_t peak = 0;
+    // The last frame hit full scale
+    bool clipping = false;
+
+    float rms_dbfs() const;
+    float peak_dbfs() const;
+};
+
+// 音量电平表：每帧计算 RMS、峰值和削波，其他模块（灯效、统计、自动增益）无锁读取最近一帧的结果
+class LevelMeter {
+public:
+    // Only the first channel is measured, the others are AEC references
+    void Process(const int16_t* data, size_t samples, int channels = 1);
+    // Safe to call from any task
+    AudioLevel GetLevel() const;
+    // Clipped samples since the last call
+    uint32_t TakeClippedSamples();
+
+private:
+    // rms in the low 16 bits, peak in bits 16-30, clipping in bit 31
+    std::atomic<uint32_t> level_{0};
+    std::atomic<uint32_t> clipped_samples_{0};
+};
+
+#endif // LEVEL_METER_H
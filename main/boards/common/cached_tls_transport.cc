@@ -0,0 +1,143 @@
+#include "cached_tls_transport.h"
+#include "tls_session_cache.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_crt_bundle.h>
+
+#define TAG "CachedTlsTransport"
+
+CachedTlsTransport::CachedTlsTransport() {
+    mbedtls_net_init(&net_);
+    mbedtls_entropy_init(&entropy_);
+    mbedtls_ctr_drbg_init(&ctr_drbg_);
+    mbedtls_ssl_init(&ssl_);
+    mbedtls_ssl_config_init(&conf_);
+}
+
+CachedTlsTransport::~CachedTlsTransport() {
+    Disconnect();
+    mbedtls_ssl_free(&ssl_);
+    mbedtls_ssl_config_free(&conf_);
+    mbedtls_ctr_drbg_free(&ctr_drbg_);
+    mbedtls_entropy_free(&entropy_);
+}
+
+// Done once, a reconnect only resets the session
+bool CachedTlsTransport::SetupSsl() {
+    int ret = mbedtls_ctr_drbg_seed(&ctr_drbg_, mbedtls_entropy_func, &entropy_, nullptr, 0);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "mbedtls_ctr_drbg_seed failed: -0x%x", -ret);
+        return false;
+    }
+    ret = mbedtls_ssl_config_defaults(&conf_, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_config_defaults failed: -0x%x", -ret);
+        return false;
+    }
+    mbedtls_ssl_conf_authmode(&conf_, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_rng(&conf_, mbedtls_ctr_drbg_random, &ctr_drbg_);
+    mbedtls_ssl_conf_session_tickets(&conf_, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+    esp_crt_bundle_attach(&conf_);
+
+    ret = mbedtls_ssl_setup(&ssl_, &conf_);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_setup failed: -0x%x", -ret);
+        return false;
+    }
+    ssl_ready_ = true;
+    return true;
+}
+
+bool CachedTlsTransport::Connect(const char* host, int port) {
+    key_ = std::string(host) + ":" + std::to_string(port);
+    if (!ssl_ready_ && !SetupSsl()) {
+        return false;
+    }
+    int ret = mbedtls_ssl_set_hostname(&ssl_, host);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_set_hostname failed: -0x%x", -ret);
+        return false;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    ret = mbedtls_net_connect(&net_, host, std::to_string(port).c_str(), MBEDTLS_NET_PROTO_TCP);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to connect to %s: -0x%x", key_.c_str(), -ret);
+        return false;
+    }
+    mbedtls_ssl_set_bio(&ssl_, &net_, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+    auto& cache = TlsSessionCache::GetInstance();
+    bool offered = cache.Apply(key_, &ssl_);
+    while ((ret = mbedtls_ssl_handshake(&ssl_)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            ESP_LOGE(TAG, "TLS handshake with %s failed: -0x%x", key_.c_str(), -ret);
+            if (offered) {
+                // Do not offer it again, the next attempt does a full handshake
+                cache.Remove(key_);
+            }
+            mbedtls_net_free(&net_);
+            mbedtls_ssl_session_reset(&ssl_);
+            return false;
+        }
+    }
+    cache.RecordHandshake(key_, offered, (esp_timer_get_time() - start_time) / 1000);
+    cache.Store(key_, &ssl_);
+
+    connected_ = true;
+    return true;
+}
+
+void CachedTlsTransport::Disconnect() {
+    if (!connected_) {
+        return;
+    }
+    connected_ = false;
+    // TLS 1.3 tickets arrive after the handshake, keep whatever the server sent since
+    TlsSessionCache::GetInstance().Store(key_, &ssl_);
+    mbedtls_ssl_close_notify(&ssl_);
+    mbedtls_net_free(&net_);
+    mbedtls_ssl_session_reset(&ssl_);
+}
+
+int CachedTlsTransport::Send(const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        int ret = mbedtls_ssl_write(&ssl_, (const unsigned char*)data + sent, length - sent);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (ret < 0) {
+            ESP_LOGE(TAG, "mbedtls_ssl_write failed: -0x%x", -ret);
+            connected_ = false;
+            return ret;
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+int CachedTlsTransport::Receive(char* buffer, size_t buffer_size) {
+    while (true) {
+        int ret = mbedtls_ssl_read(&ssl_, (unsigned char*)buffer, buffer_size);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+        if (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) {
+            TlsSessionCache::GetInstance().Store(key_, &ssl_);
+            continue;
+        }
+#endif
+        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            connected_ = false;
+            return 0;
+        }
+        if (ret < 0) {
+            ESP_LOGE(TAG, "mbedtls_ssl_read failed: -0x%x", -ret);
+            connected_ = false;
+        }
+        return ret;
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef CACHED_TLS_TRANSPORT_H
+#define CACHED_TLS_TRANSPORT_H
+
+#include <transport.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+
+#include <string>
+
+// TLS transport that offers the session cached in TlsSessionCache for the host, and stores the
+// session the server hands out for the next connection
+class CachedTlsTransport : public Transport {
+public:
+    CachedTlsTransport();
+    ~CachedTlsTransport();
+
+    bool Connect(const char* host, int port) override;
+    void Disconnect() override;
+    int Send(const char* data, size_t length) override;
+    int Receive(char* buffer, size_t buffer_size) override;
+
+private:
+    std::string key_;
+    bool ssl_ready_ = false;
+    mbedtls_net_context net_;
+    mbedtls_entropy_context entropy_;
+    mbedtls_ctr_drbg_context ctr_drbg_;
+    mbedtls_ssl_context ssl_;
+    mbedtls_ssl_config conf_;
+
+    bool SetupSsl();
+};
+
+#endif // CACHED_TLS_TRANSPORT_H
@@ -0,0 +1,152 @@
+#include "tls_session_cache.h"
+
+#include <cstring>
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_rom_crc.h>
+
+#define TAG "TlsSessionCache"
+
+#define MAX_CACHED_SESSIONS 4
+// A saved session carries the peer certificate when MBEDTLS_SSL_KEEP_PEER_CERTIFICATE is on
+#define MAX_SESSION_SIZE 2048
+#define MAX_KEY_LENGTH 64
+
+#if CONFIG_TLS_SESSION_CACHE_PERSIST_RTC
+#define RTC_SESSION_MAGIC 0x544c5353
+
+// Survives esp_restart and deep sleep, not a power cycle
+struct RtcSession {
+    uint32_t magic;
+    uint32_t checksum;
+    uint16_t key_length;
+    uint16_t session_length;
+    char key[MAX_KEY_LENGTH];
+    uint8_t session[MAX_SESSION_SIZE];
+};
+static RTC_NOINIT_ATTR RtcSession rtc_session;
+
+static uint32_t RtcSessionChecksum() {
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)rtc_session.key, rtc_session.key_length);
+    return esp_rom_crc32_le(crc, rtc_session.session, rtc_session.session_length);
+}
+#endif
+
+TlsSessionCache::TlsSessionCache() {
+#if CONFIG_TLS_SESSION_CACHE_PERSIST_RTC
+    if (rtc_session.magic == RTC_SESSION_MAGIC && rtc_session.key_length <= MAX_KEY_LENGTH &&
+        rtc_session.session_length <= MAX_SESSION_SIZE && rtc_session.checksum == RtcSessionChecksum()) {
+        Entry entry;
+        entry.key.assign(rtc_session.key, rtc_session.key_length);
+        entry.session.assign(rtc_session.session, rtc_session.session + rtc_session.session_length);
+        ESP_LOGI(TAG, "Restored TLS session for %s from RTC memory", entry.key.c_str());
+        entries_.push_front(std::move(entry));
+    }
+#endif
+}
+
+bool TlsSessionCache::Apply(const std::string& key, mbedtls_ssl_context* ssl) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->key != key) {
+            continue;
+        }
+        mbedtls_ssl_session session;
+        mbedtls_ssl_session_init(&session);
+        int ret = mbedtls_ssl_session_load(&session, it->session.data(), it->session.size());
+        if (ret == 0) {
+            ret = mbedtls_ssl_set_session(ssl, &session);
+        }
+        mbedtls_ssl_session_free(&session);
+        if (ret != 0) {
+            // Saved by another mbedtls build or configuration
+            ESP_LOGW(TAG, "Cannot use the cached session for %s: -0x%x", key.c_str(), -ret);
+            entries_.erase(it);
+            return false;
+        }
+        entries_.splice(entries_.begin(), entries_, it);
+        return true;
+    }
+    return false;
+}
+
+void TlsSessionCache::Store(const std::string& key, const mbedtls_ssl_context* ssl) {
+    if (key.size() > MAX_KEY_LENGTH) {
+        return;
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    std::vector<uint8_t> data;
+    size_t length = 0;
+    // No session yet is normal for TLS 1.3 before the server sends its ticket
+    int ret = mbedtls_ssl_get_session(ssl, &session);
+    if (ret == 0) {
+        mbedtls_ssl_session_save(&session, nullptr, 0, &length);
+        if (length > 0 && length <= MAX_SESSION_SIZE) {
+            data.resize(length);
+            ret = mbedtls_ssl_session_save(&session, data.data(), data.size(), &length);
+        } else {
+            ret = -1;
+        }
+    }
+    mbedtls_ssl_session_free(&session);
+    if (ret != 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->key == key) {
+            if (it->session == data) {
+                // The server resumed the session it issued before, nothing new to keep
+                return;
+            }
+            entries_.erase(it);
+            break;
+        }
+    }
+    entries_.push_front(Entry{key, std::move(data)});
+    if (entries_.size() > MAX_CACHED_SESSIONS) {
+        entries_.pop_back();
+    }
+    SaveToRtc(entries_.front());
+}
+
+void TlsSessionCache::Remove(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.remove_if([&key](const Entry& entry) {
+        return entry.key == key;
+    });
+#if CONFIG_TLS_SESSION_CACHE_PERSIST_RTC
+    if (rtc_session.magic == RTC_SESSION_MAGIC && key.compare(0, std::string::npos, rtc_session.key, rtc_session.key_length) == 0) {
+        rtc_session.magic = 0;
+    }
+#endif
+}
+
+void TlsSessionCache::SaveToRtc(const Entry& entry) {
+#if CONFIG_TLS_SESSION_CACHE_PERSIST_RTC
+    rtc_session.magic = 0;
+    rtc_session.key_length = entry.key.size();
+    rtc_session.session_length = entry.session.size();
+    memcpy(rtc_session.key, entry.key.data(), entry.key.size());
+    memcpy(rtc_session.session, entry.session.data(), entry.session.size());
+    rtc_session.checksum = RtcSessionChecksum();
+    rtc_session.magic = RTC_SESSION_MAGIC;
+#endif
+}
+
+void TlsSessionCache::RecordHandshake(const std::string& key, bool offered, int elapsed_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    handshake_count_[offered]++;
+    handshake_time_total_ms_[offered] += elapsed_ms;
+
+    int64_t full_average_ms = handshake_count_[0] ? handshake_time_total_ms_[0] / handshake_count_[0] : 0;
+    int64_t offered_average_ms = handshake_count_[1] ? handshake_time_total_ms_[1] / handshake_count_[1] : 0;
+    // Only meaningful once both kinds have been seen
+    int64_t saved_ms = full_average_ms > 0 ? (full_average_ms - offered_average_ms) * handshake_count_[1] : 0;
+    ESP_LOGI(TAG, "TLS handshake with %s in %d ms (%s); full %lu avg %lld ms, cached %lu avg %lld ms, saved about %lld ms",
+        key.c_str(), elapsed_ms, offered ? "cached session" : "full", handshake_count_[0], full_average_ms,
+        handshake_count_[1], offered_average_ms, saved_ms);
+}
@@ -0,0 +1,44 @@
+#ifndef TLS_SESSION_CACHE_H
+#define TLS_SESSION_CACHE_H
+
+#include <mbedtls/ssl.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+
+// Serialized TLS sessions (session ID or ticket) per host:port, shared by every connection made
+// through CachedTlsTransport. Offering a cached session lets the server skip the certificate
+// exchange and the key agreement of a full handshake.
+// The most recent session is also kept in RTC memory, so a warm boot can resume it
+class TlsSessionCache {
+public:
+    static TlsSessionCache& GetInstance() {
+        static TlsSessionCache instance;
+        return instance;
+    }
+
+    // Offers the cached session for key on ssl, false if there is none
+    bool Apply(const std::string& key, mbedtls_ssl_context* ssl);
+    void Store(const std::string& key, const mbedtls_ssl_context* ssl);
+    void Remove(const std::string& key);
+    // Counts and times handshakes, with and without a session offered
+    void RecordHandshake(const std::string& key, bool offered, int elapsed_ms);
+
+private:
+    struct Entry {
+        std::string key;
+        std::vector<uint8_t> session;
+    };
+
+    std::mutex mutex_;
+    std::list<Entry> entries_;  // most recently used first
+    uint32_t handshake_count_[2] = {};  // full, session offered
+    int64_t handshake_time_total_ms_[2] = {};
+
+    TlsSessionCache();
+    void SaveToRtc(const Entry& entry);
+};
+
+#endif // TLS_SESSION_CACHE_H
@@ -4,6 +4,7 @@
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
+#include "cached_tls_transport.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -148,7 +149,7 @@ void WifiBoard::StartNetwork() {
     esp_err_t err = app_network_start(POP_TYPE_NONE);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Could not start Wifi. Aborting!!!");
-        application.Alert("联网", "网络连接错误", "", Lang::Sounds::P3_ERR_WIFICONNECT);
+        application.Alert("联网", "网络连接错误", "", Lang::Sounds::P3_ERR_WIFICONNECT, kPromptPriorityError);
         vTaskDelay(pdMS_TO_TICKS(5000));
         abort();
     }
@@ -167,7 +168,11 @@ WebSocket* WifiBoard::CreateWebSocket() {
 #ifdef CONFIG_CONNECTION_TYPE_WEBSOCKET
     std::string url = CONFIG_WEBSOCKET_URL;
     if (url.find("wss://") == 0) {
+#if CONFIG_USE_TLS_SESSION_CACHE
+        return new WebSocket(new CachedTlsTransport());
+#else
         return new WebSocket(new TlsTransport());
+#endif
     } else {
         return new WebSocket(new TcpTransport());
     }
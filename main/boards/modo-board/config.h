@@ -3,7 +3,17 @@
 //modonut
 #include <driver/gpio.h>
 
+// ES7210 与 ES8311 共用 MCLK/BCLK/WS 时只能工作在同一采样率，采集数据需要先重采样到 16kHz 再送入 AFE。
+// 若硬件为 ES7210 单独引出时钟线，定义下面的 AUDIO_I2S_MIC_GPIO_* 即可让采集直接运行在 16kHz，
+// 播放仍保持服务器的 24kHz
+// #define AUDIO_I2S_MIC_GPIO_MCLK GPIO_NUM_NC
+// #define AUDIO_I2S_MIC_GPIO_WS   GPIO_NUM_NC
+// #define AUDIO_I2S_MIC_GPIO_BCLK GPIO_NUM_NC
+#ifdef AUDIO_I2S_MIC_GPIO_BCLK
+#define AUDIO_INPUT_SAMPLE_RATE  16000
+#else
 #define AUDIO_INPUT_SAMPLE_RATE  24000
+#endif
 #define AUDIO_OUTPUT_SAMPLE_RATE 24000
 #define AUDIO_DEFAULT_OUTPUT_VOLUME 100
 
@@ -101,6 +101,24 @@ public:
     }
 
     virtual AudioCodec* GetAudioCodec() override {
+#ifdef AUDIO_I2S_MIC_GPIO_BCLK
+        static BoxAudioCodec audio_codec(
+            i2c_bus_,
+            AUDIO_INPUT_SAMPLE_RATE,
+            AUDIO_OUTPUT_SAMPLE_RATE,
+            AUDIO_I2S_GPIO_MCLK,
+            AUDIO_I2S_GPIO_BCLK,
+            AUDIO_I2S_GPIO_WS,
+            AUDIO_I2S_GPIO_DOUT,
+            AUDIO_I2S_MIC_GPIO_MCLK,
+            AUDIO_I2S_MIC_GPIO_BCLK,
+            AUDIO_I2S_MIC_GPIO_WS,
+            AUDIO_I2S_GPIO_DIN,
+            AUDIO_CODEC_PA_PIN,
+            AUDIO_CODEC_ES8311_ADDR,
+            AUDIO_CODEC_ES7210_ADDR,
+            AUDIO_INPUT_REFERENCE);
+#else
         static BoxAudioCodec audio_codec(
             i2c_bus_, 
             AUDIO_INPUT_SAMPLE_RATE, 
@@ -114,6 +132,7 @@ public:
             AUDIO_CODEC_ES8311_ADDR, 
             AUDIO_CODEC_ES7210_ADDR, 
             AUDIO_INPUT_REFERENCE);
+#endif
         return &audio_codec;
     }
 
@@ -0,0 +1,133 @@
+#include "drift_compensator.h"
+
+#include <esp_log.h>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#define TAG "DriftCompensator"
+
+// Time constant of the depth smoothing, long enough to hide network jitter
+#define DEPTH_SMOOTHING_MS 2000
+// The trend is measured over this window
+#define TREND_WINDOW_MS 20000
+// The trend is only measured while the depth stays this close to the target
+#define STEADY_DEPTH_TOLERANCE_PERCENT 50
+// A depth error is corrected over this time, so the correction stays far below audibility
+#define ERROR_CORRECTION_SECONDS 60
+// Frames below this mean square count as quiet (about -40dBFS)
+#define QUIET_ENERGY 107000
+// Adjust in loud frames too if this many samples are pending
+#define MAX_PENDING_SAMPLES 8
+
+DriftCompensator::DriftCompensator(int target_depth_ms, int max_ppm)
+    : target_depth_ms_(target_depth_ms), max_ppm_(max_ppm) {
+}
+
+void DriftCompensator::Reset() {
+    reset_requested_ = true;
+}
+
+void DriftCompensator::Update(int64_t time_us, int depth_ms) {
+    if (reset_requested_.exchange(false)) {
+        // A new stream may come from another server or follow a polluted estimate, start over
+        last_time_us_ = time_us;
+        smoothed_depth_ms_ = depth_ms;
+        window_start_us_ = time_us;
+        window_start_depth_ms_ = depth_ms;
+        pending_samples_ = 0;
+        drift_ppm_ = 0;
+        correction_ppm_ = 0;
+        // The buffer fills at the start of a stream, that is not a trend
+        warming_up_ = true;
+        return;
+    }
+
+    int64_t elapsed_us = time_us - last_time_us_;
+    last_time_us_ = time_us;
+    if (elapsed_us <= 0) {
+        return;
+    }
+    double alpha = std::min(1.0, elapsed_us / (DEPTH_SMOOTHING_MS * 1000.0));
+    smoothed_depth_ms_ += (depth_ms - smoothed_depth_ms_) * alpha;
+
+    // Only a buffer held near its target by a real time stream follows the clocks. An underrun,
+    // a pause between sentences or a burst faster than real time says nothing about them
+    bool steady = depth_ms > 0 &&
+        std::abs(smoothed_depth_ms_ - target_depth_ms_) * 100 <= target_depth_ms_ * STEADY_DEPTH_TOLERANCE_PERCENT;
+    int64_t window_us = time_us - window_start_us_;
+    if (!steady) {
+        window_start_us_ = time_us;
+        window_start_depth_ms_ = smoothed_depth_ms_;
+        // The smoothed depth still carries the excursion, the next window only lets it settle
+        warming_up_ = true;
+    } else if (window_us >= TREND_WINDOW_MS * 1000) {
+        // Depth growth in ms per second of playback is the clock difference in thousandths
+        double growth_ppm = (smoothed_depth_ms_ - window_start_depth_ms_) * 1e6 / (window_us / 1000.0);
+        // The correction already applied is part of what we measured
+        double measured_ppm = growth_ppm + correction_ppm_;
+        if (warming_up_) {
+            warming_up_ = false;
+        } else if (std::abs(measured_ppm) > max_ppm_) {
+            // No crystal is that far off, something other than the clocks moved the depth
+            ESP_LOGD(TAG, "Ignoring a trend of %.0f ppm", measured_ppm);
+        } else {
+            drift_ppm_ += (int)((measured_ppm - drift_ppm_) * 0.3);
+        }
+        window_start_us_ = time_us;
+        window_start_depth_ms_ = smoothed_depth_ms_;
+    }
+
+    // Away from the target the depth is set by the network, pulling it back would only distort the audio
+    double error_ppm = steady ? (smoothed_depth_ms_ - target_depth_ms_) * 1000.0 / ERROR_CORRECTION_SECONDS : 0;
+    correction_ppm_ = std::clamp((int)(drift_ppm_ + error_ppm), -max_ppm_, max_ppm_);
+}
+
+void DriftCompensator::Process(std::vector<int16_t>& pcm, int channels) {
+    int frames = pcm.size() / channels;
+    if (frames < 2) {
+        return;
+    }
+    pending_samples_ += frames * (correction_ppm_ / 1e6);
+    if (std::abs(pending_samples_) < 1) {
+        return;
+    }
+
+    int64_t sum = 0;
+    for (int i = 0; i < frames; i++) {
+        int32_t sample = pcm[i * channels];
+        sum += sample * sample;
+    }
+    if (sum / frames > QUIET_ENERGY && std::abs(pending_samples_) < MAX_PENDING_SAMPLES) {
+        return;
+    }
+
+    // The smoothest point of the frame hides a dropped or repeated sample best
+    int best = 0;
+    int32_t best_score = INT32_MAX;
+    for (int i = 0; i + 1 < frames; i++) {
+        int32_t a = pcm[i * channels];
+        int32_t b = pcm[(i + 1) * channels];
+        int32_t score = std::abs(a) + std::abs(b - a);
+        if (score < best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+
+    auto position = pcm.begin() + best * channels;
+    if (pending_samples_ >= 1) {
+        pcm.erase(position, position + channels);
+        pending_samples_ -= 1;
+        adjusted_samples_++;
+    } else {
+        std::vector<int16_t> frame(position, position + channels);
+        pcm.insert(position, frame.begin(), frame.end());
+        pending_samples_ += 1;
+        adjusted_samples_--;
+    }
+}
+
+int DriftCompensator::TakeAdjustedSamples() {
+    return adjusted_samples_.exchange(0);
+}
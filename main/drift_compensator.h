@@ -0,0 +1,45 @@
+#ifndef DRIFT_COMPENSATOR_H
+#define DRIFT_COMPENSATOR_H
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+// Keeps the playout buffer at its target depth when the I2S clock runs slightly faster or slower
+// than the server. The drift is estimated from the trend of the buffer depth while it stays near the
+// target, and compensated by dropping or repeating single samples, preferably in quiet frames.
+// Update and Process must be called from the same task.
+class DriftCompensator {
+public:
+    DriftCompensator(int target_depth_ms = 300, int max_ppm = 500);
+
+    // Call for every new stream. Can be called from any task, takes effect on the next Update
+    void Reset();
+    // Depth of the buffered audio when a packet is about to be played
+    void Update(int64_t time_us, int depth_ms);
+    // Drops or repeats samples in the decoded frame according to the current correction
+    void Process(std::vector<int16_t>& pcm, int channels);
+
+    // Positive when playback is sped up (samples dropped)
+    inline int correction_ppm() const { return correction_ppm_; }
+    inline int drift_ppm() const { return drift_ppm_; }
+    // Samples dropped (positive) or inserted (negative) since the last call
+    int TakeAdjustedSamples();
+
+private:
+    int target_depth_ms_;
+    int max_ppm_;
+    std::atomic<bool> reset_requested_{true};
+
+    int64_t last_time_us_ = 0;
+    double smoothed_depth_ms_ = 0;
+    int64_t window_start_us_ = 0;
+    double window_start_depth_ms_ = 0;
+    bool warming_up_ = true;
+    int drift_ppm_ = 0;
+    int correction_ppm_ = 0;
+    double pending_samples_ = 0;
+    std::atomic<int> adjusted_samples_{0};
+};
+
+#endif // DRIFT_COMPENSATOR_H
@@ -1,4 +1,5 @@
 #include "nfc_task.h"
+#include "Mifare_005M.h"
 
 #define NFC_TAG "NfcTask"
 
@@ -50,6 +51,10 @@ void NfcTask::OnNfcWakeDetected(std::function<void(const std::string& wake_word)
     nfc_wake_detected_callback_ = callback;
 }
 
+void NfcTask::OnNfcCardPresent(std::function<void(void)> callback) {
+    nfc_card_present_callback_ = callback;
+}
+
 void NfcTask::OnNfcDisCon(std::function<void(void)> callback){
     nfc_disconn_callback_ = callback;
 }
@@ -89,7 +94,21 @@ void NfcTask::NfcTaskLoop() {
         // write_buff[3] = 99;
         // success = PCD_WRITE_CARD(write_buff, 4, rece_buff, &rece_length);
 
-        success = PCD_READ_CARD(rece_buff, &rece_length);
+        // 与 PCD_READ_CARD 相同，拆开是为了在 ATQA 之后、读卡之前通知卡片靠近
+        success = FM175XX_ERROR;
+        if (TypeA_Request(PICC_ATQA) == OK) {
+            // 同一张卡片停留期间只通知一次
+            if (!card_present_ && !detected_ && nfc_card_present_callback_) {
+                nfc_card_present_callback_();
+            }
+            card_present_ = true;
+            success = MIFARE_005M_READ_APP(rece_buff, &rece_length);
+        } else {
+            card_present_ = false;
+        }
+        if (success != OK) {
+            vTaskDelay(pdMS_TO_TICKS(5));
+        }
         // ESP_LOGI(NFC_TAG, "success = %d, detected_ = %d", success, detected_);
         if ((success == OK)  && (detected_ == false)) {
             detected_ = true;
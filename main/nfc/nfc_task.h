@@ -31,6 +31,7 @@ public:
     void OnReady(std::function<bool(void)> callback);
     void OnNfcStateChange(std::function<void(bool)> callback);
     void OnNfcWakeDetected(std::function<void(const std::string& wake_word)> callback);    // 检测到NFC后的逻辑操作
+    void OnNfcCardPresent(std::function<void(void)> callback);    // 卡片应答 ATQA，读卡之前
     void OnNfcDisCon(std::function<void(void)> callback);
 
     // 事件控制
@@ -41,6 +42,8 @@ public:
 private:
     uint32_t stack_size_ = 8192;
     bool detected_ = false;
+    // The card in the field answered ATQA, cleared once it stops answering
+    bool card_present_ = false;
     TaskHandle_t nfc_task_handle_;
     EventGroupHandle_t event_group_;
 
@@ -48,6 +51,7 @@ private:
     std::function<bool(void)> on_ready_;  // NFC识别回调函数
     std::function<void(bool)> spi_state_change_callback_;
     std::function<void(const std::string& wake_word)> nfc_wake_detected_callback_;
+    std::function<void(void)> nfc_card_present_callback_;
     std::function<void(void)> nfc_disconn_callback_;
 
     void NfcTaskLoop();
@@ -0,0 +1,230 @@
+#include "opus_benchmark.h"
+#include "protocol.h"
+#include "assets/lang_config.h"
+
+#include <opus_encoder.h>
+#include <opus_decoder.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <string_view>
+
+#define TAG "OpusBenchmark"
+
+#define BENCHMARK_SAMPLE_RATE 16000
+#define BENCHMARK_MAX_LAG 320
+// Above the audio loop (8) and every other task of the application, so nothing preempts an encode
+#define BENCHMARK_TASK_PRIORITY 10
+// The idle task of the benchmark core needs a tick now and then for the task watchdog
+#define BENCHMARK_YIELD_FRAMES 16
+
+std::vector<int16_t> OpusBenchmark::LoadCorpus(int sample_rate, int max_ms) {
+    // The speech prompts are the only speech we carry on the device, they are 16kHz 60ms p3 streams
+    const std::string_view sounds[] = {
+        Lang::Sounds::P3_WELCOME,
+        Lang::Sounds::P3_WIFICONFIG,
+        Lang::Sounds::P3_ACTIVATION,
+        Lang::Sounds::P3_UPGRADE,
+        Lang::Sounds::P3_ERR_REG,
+        Lang::Sounds::P3_ERR_PIN,
+        Lang::Sounds::P3_0, Lang::Sounds::P3_1, Lang::Sounds::P3_2, Lang::Sounds::P3_3, Lang::Sounds::P3_4,
+        Lang::Sounds::P3_5, Lang::Sounds::P3_6, Lang::Sounds::P3_7, Lang::Sounds::P3_8, Lang::Sounds::P3_9,
+    };
+    size_t max_samples = (size_t)sample_rate * max_ms / 1000;
+
+    std::vector<int16_t> corpus;
+    corpus.reserve(max_samples);
+    OpusDecoderWrapper decoder(sample_rate, 1, 60);
+    for (const auto& sound : sounds) {
+        decoder.ResetState();
+        const char* data = sound.data();
+        size_t size = sound.size();
+        for (const char* p = data; p < data + size && corpus.size() < max_samples; ) {
+            auto p3 = (BinaryProtocol3*)p;
+            p += sizeof(BinaryProtocol3);
+            auto payload_size = ntohs(p3->payload_size);
+            std::vector<uint8_t> opus(p3->payload, p3->payload + payload_size);
+            p += payload_size;
+
+            std::vector<int16_t> pcm;
+            if (decoder.Decode(std::move(opus), pcm)) {
+                size_t count = std::min(pcm.size(), max_samples - corpus.size());
+                corpus.insert(corpus.end(), pcm.begin(), pcm.begin() + count);
+            }
+        }
+    }
+    return corpus;
+}
+
+float OpusBenchmark::SegmentalSnr(const std::vector<int16_t>& reference, const std::vector<int16_t>& decoded, int sample_rate) {
+    // The decoder output lags the input by the encoder lookahead, find it by cross correlation
+    size_t length = std::min(reference.size(), decoded.size());
+    if (length <= BENCHMARK_MAX_LAG) {
+        return 0;
+    }
+    int best_lag = 0;
+    int64_t best_corr = INT64_MIN;
+    for (int lag = 0; lag < BENCHMARK_MAX_LAG; lag++) {
+        int64_t corr = 0;
+        for (size_t i = 0; i + lag < length; i += 4) {
+            corr += (int32_t)reference[i] * decoded[i + lag];
+        }
+        if (corr > best_corr) {
+            best_corr = corr;
+            best_lag = lag;
+        }
+    }
+
+    // Classic segmental SNR over 20ms segments, clamped to [-10, 35] dB, silent segments skipped
+    size_t segment = sample_rate / 50;
+    double total = 0;
+    int segments = 0;
+    for (size_t start = 0; start + segment + best_lag <= length; start += segment) {
+        double signal = 0, noise = 0;
+        for (size_t i = start; i < start + segment; i++) {
+            double s = reference[i];
+            double e = s - decoded[i + best_lag];
+            signal += s * s;
+            noise += e * e;
+        }
+        if (signal < segment * 100.0) {
+            continue;
+        }
+        double snr = 10 * log10(signal / std::max(noise, 1.0));
+        total += std::clamp(snr, -10.0, 35.0);
+        segments++;
+    }
+    return segments > 0 ? total / segments : 0;
+}
+
+OpusBenchmark::Result OpusBenchmark::RunOne(const std::vector<int16_t>& corpus, int complexity, int application,
+    bool dtx, int duration_ms, int bitrate) {
+    Result result = {};
+    result.complexity = complexity;
+    result.application = application;
+    result.dtx = dtx;
+    result.duration_ms = duration_ms;
+    result.bitrate = bitrate;
+
+    OpusEncoderWrapper encoder(BENCHMARK_SAMPLE_RATE, 1, duration_ms, application);
+    OpusDecoderWrapper decoder(BENCHMARK_SAMPLE_RATE, 1, duration_ms);
+    encoder.SetComplexity(complexity);
+    encoder.SetDtx(dtx);
+    encoder.SetBitrate(bitrate);
+
+    size_t frame_size = BENCHMARK_SAMPLE_RATE / 1000 * duration_ms;
+    std::vector<int> sizes;
+    std::vector<int16_t> decoded;
+    sizes.reserve(corpus.size() / frame_size);
+    decoded.reserve(corpus.size());
+
+    int64_t encode_total = 0;
+    for (size_t offset = 0; offset + frame_size <= corpus.size(); offset += frame_size) {
+        if (sizes.size() % BENCHMARK_YIELD_FRAMES == BENCHMARK_YIELD_FRAMES - 1) {
+            // Between two timed encodes, the pause is not counted
+            vTaskDelay(1);
+        }
+        std::vector<int16_t> frame(corpus.begin() + offset, corpus.begin() + offset + frame_size);
+        std::vector<uint8_t> packet;
+        int64_t start_time = esp_timer_get_time();
+        encoder.Encode(std::move(frame), [&packet](std::vector<uint8_t>&& opus) {
+            packet = std::move(opus);
+        });
+        int64_t elapsed = esp_timer_get_time() - start_time;
+        encode_total += elapsed;
+        result.encode_us_max = std::max(result.encode_us_max, elapsed);
+
+        sizes.push_back(packet.size());
+        if (packet.size() <= 2) {
+            result.dtx_frames++;
+        }
+        std::vector<int16_t> pcm;
+        if (decoder.Decode(std::move(packet), pcm)) {
+            decoded.insert(decoded.end(), pcm.begin(), pcm.end());
+        } else {
+            decoded.insert(decoded.end(), frame_size, 0);
+        }
+    }
+
+    result.frames = sizes.size();
+    if (result.frames == 0) {
+        return result;
+    }
+    int total_bytes = 0;
+    for (auto size : sizes) {
+        total_bytes += size;
+    }
+    std::sort(sizes.begin(), sizes.end());
+    result.encode_us_avg = encode_total / result.frames;
+    result.bytes_avg = total_bytes / result.frames;
+    result.bytes_p50 = sizes[sizes.size() / 2];
+    result.bytes_p95 = sizes[sizes.size() * 95 / 100];
+    result.bytes_max = sizes.back();
+    result.seg_snr = SegmentalSnr(corpus, decoded, BENCHMARK_SAMPLE_RATE);
+    return result;
+}
+
+void OpusBenchmark::Start() {
+    // Opus needs a large stack. The sweep runs pinned to one core at a fixed priority above the
+    // application's tasks and before any of them is started, so the encode times are what the
+    // encoder costs and not how much CPU was left over
+    TaskHandle_t caller = xTaskGetCurrentTaskHandle();
+    if (xTaskCreatePinnedToCore([](void* arg) {
+        OpusBenchmark::Run();
+        xTaskNotifyGive((TaskHandle_t)arg);
+        vTaskDelete(NULL);
+    }, "opus_benchmark", 4096 * 8, caller, BENCHMARK_TASK_PRIORITY, nullptr, portNUM_PROCESSORS - 1) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the benchmark task");
+        return;
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+void OpusBenchmark::Run() {
+    auto corpus = LoadCorpus(BENCHMARK_SAMPLE_RATE, CONFIG_OPUS_BENCHMARK_CORPUS_MS);
+    ESP_LOGI(TAG, "Corpus: %u samples (%u ms) at %d Hz", corpus.size(),
+        corpus.size() * 1000 / BENCHMARK_SAMPLE_RATE, BENCHMARK_SAMPLE_RATE);
+    if (corpus.empty()) {
+        return;
+    }
+
+    const int applications[] = { OPUS_APPLICATION_VOIP, OPUS_APPLICATION_RESTRICTED_LOWDELAY };
+    const int durations[] = { 20, 40, 60 };
+    const int bitrates[] = { OPUS_AUTO, 12000, 16000, 24000 };
+
+    // CPU% is the share of one core needed to encode in real time
+    ESP_LOGI(TAG, "| cx | app | dtx | ms | bitrate | enc avg us | enc max us | cpu %% | bytes avg | p50 | p95 | max | kbps | dtx frames | segSNR dB |");
+    ESP_LOGI(TAG, "|----|-----|-----|----|---------|------------|------------|-------|-----------|-----|-----|-----|------|------------|-----------|");
+    for (int application : applications) {
+        for (int duration_ms : durations) {
+            for (int bitrate : bitrates) {
+                for (int dtx = 0; dtx <= 1; dtx++) {
+                    for (int complexity = 0; complexity <= 10; complexity++) {
+                        auto r = RunOne(corpus, complexity, application, dtx, duration_ms, bitrate);
+                        char bitrate_str[16];
+                        if (bitrate == OPUS_AUTO) {
+                            strcpy(bitrate_str, "auto");
+                        } else {
+                            snprintf(bitrate_str, sizeof(bitrate_str), "%d", bitrate);
+                        }
+                        ESP_LOGI(TAG, "| %2d | %s | %3s | %2d | %7s | %10lld | %10lld | %5.1f | %9d | %3d | %3d | %3d | %4.1f | %10d | %9.2f |",
+                            r.complexity, r.application == OPUS_APPLICATION_VOIP ? "voip" : "rldl",
+                            r.dtx ? "on" : "off", r.duration_ms, bitrate_str,
+                            r.encode_us_avg, r.encode_us_max, r.encode_us_avg * 100.0 / (r.duration_ms * 1000),
+                            r.bytes_avg, r.bytes_p50, r.bytes_p95, r.bytes_max,
+                            r.bytes_avg * 8.0 / r.duration_ms, r.dtx_frames, r.seg_snr);
+                        // Let the idle task feed the watchdog between runs
+                        vTaskDelay(1);
+                    }
+                }
+            }
+        }
+    }
+    ESP_LOGI(TAG, "Benchmark finished");
+}
@@ -0,0 +1,40 @@
+#ifndef _OPUS_BENCHMARK_H_
+#define _OPUS_BENCHMARK_H_
+
+#include <vector>
+#include <cstdint>
+
+// Sweeps OpusEncoderWrapper settings over the embedded speech prompts and logs a
+// table of encode time, packet size distribution and segmental SNR per setting.
+class OpusBenchmark {
+public:
+    // Runs the sweep on a pinned high priority task and returns when it is done. Called at the
+    // start of the boot, the sweep takes minutes
+    static void Start();
+    static void Run();
+
+private:
+    struct Result {
+        int complexity;
+        int application;
+        bool dtx;
+        int duration_ms;
+        int bitrate;
+        int frames;
+        int64_t encode_us_avg;
+        int64_t encode_us_max;
+        int bytes_avg;
+        int bytes_p50;
+        int bytes_p95;
+        int bytes_max;
+        int dtx_frames;
+        float seg_snr;
+    };
+
+    static std::vector<int16_t> LoadCorpus(int sample_rate, int max_ms);
+    static Result RunOne(const std::vector<int16_t>& corpus, int complexity, int application,
+        bool dtx, int duration_ms, int bitrate);
+    static float SegmentalSnr(const std::vector<int16_t>& reference, const std::vector<int16_t>& decoded, int sample_rate);
+};
+
+#endif // _OPUS_BENCHMARK_H_
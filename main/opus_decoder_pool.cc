@@ -0,0 +1,60 @@
+#include "opus_decoder_pool.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusDecoderPool"
+
+OpusDecoderPool::OpusDecoderPool(size_t capacity) : capacity_(capacity) {
+    entries_.reserve(capacity_);
+}
+
+OpusDecoderPool::~OpusDecoderPool() {
+}
+
+OpusDecoderPool::Entry* OpusDecoderPool::Find(int sample_rate, int duration_ms) {
+    for (auto& entry : entries_) {
+        if (entry.sample_rate == sample_rate && entry.duration_ms == duration_ms) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool OpusDecoderPool::Contains(int sample_rate, int duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Find(sample_rate, duration_ms) != nullptr;
+}
+
+bool OpusDecoderPool::IsFull() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size() >= capacity_;
+}
+
+OpusDecoderWrapper* OpusDecoderPool::Get(int sample_rate, int duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = Find(sample_rate, duration_ms);
+    if (entry != nullptr) {
+        entry->last_used = ++use_counter_;
+        return entry->decoder.get();
+    }
+
+    if (entries_.size() >= capacity_) {
+        auto lru = entries_.begin();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->last_used < lru->last_used) {
+                lru = it;
+            }
+        }
+        ESP_LOGI(TAG, "Evict decoder %d Hz %d ms", lru->sample_rate, lru->duration_ms);
+        entries_.erase(lru);
+    }
+
+    ESP_LOGI(TAG, "Create decoder %d Hz %d ms", sample_rate, duration_ms);
+    entries_.push_back(Entry{
+        .sample_rate = sample_rate,
+        .duration_ms = duration_ms,
+        .last_used = ++use_counter_,
+        .decoder = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, duration_ms),
+    });
+    return entries_.back().decoder.get();
+}
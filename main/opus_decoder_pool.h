@@ -0,0 +1,38 @@
+#ifndef OPUS_DECODER_POOL_H
+#define OPUS_DECODER_POOL_H
+
+#include <opus_decoder.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Keeps a few warm decoders keyed by (sample rate, frame duration), so switching
+// between prompt and TTS playback does not destroy and recreate the decoder
+class OpusDecoderPool {
+public:
+    OpusDecoderPool(size_t capacity = 3);
+    ~OpusDecoderPool();
+
+    // Returns the decoder for the format, creating it (and evicting the least recently used one when full)
+    OpusDecoderWrapper* Get(int sample_rate, int duration_ms);
+    bool Contains(int sample_rate, int duration_ms);
+    bool IsFull();
+
+private:
+    struct Entry {
+        int sample_rate;
+        int duration_ms;
+        uint32_t last_used;
+        std::unique_ptr<OpusDecoderWrapper> decoder;
+    };
+
+    std::mutex mutex_;
+    size_t capacity_;
+    uint32_t use_counter_ = 0;
+    std::vector<Entry> entries_;
+
+    Entry* Find(int sample_rate, int duration_ms);
+};
+
+#endif // OPUS_DECODER_POOL_H
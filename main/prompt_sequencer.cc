@@ -0,0 +1,136 @@
+#include "prompt_sequencer.h"
+#include "protocol.h"
+
+#include <esp_log.h>
+#include <arpa/inet.h>
+
+#define TAG "PromptSequencer"
+
+PromptSequencer::PromptSequencer() {
+}
+
+PromptSequencer::~PromptSequencer() {
+}
+
+void PromptSequencer::Initialize(int output_sample_rate) {
+    decoder_ = std::make_unique<OpusDecoderWrapper>(output_sample_rate, 1, 60);
+}
+
+void PromptSequencer::Play(std::vector<std::string_view> sounds, PromptPriority priority, CompletionCallback on_complete) {
+    bool has_packets = false;
+    for (auto& sound : sounds) {
+        has_packets |= sound.size() >= sizeof(BinaryProtocol3);
+    }
+    if (!has_packets) {
+        if (on_complete) {
+            on_complete(true);
+        }
+        return;
+    }
+
+    CompletionCallback preempted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Preempt the prompt list that is playing if it has a lower priority
+        if (playing_ && !lists_.empty() && lists_.front().priority < priority) {
+            ESP_LOGI(TAG, "Prompt priority %d preempts %d", priority, lists_.front().priority);
+            preempted = std::move(lists_.front().on_complete);
+            lists_.pop_front();
+            playing_ = false;
+            // Its packets still queued for decoding are dropped, and the decoder is reset before the next one
+            generation_++;
+        }
+
+        // Keep the queue sorted by priority, first in first out within one priority
+        auto it = lists_.begin();
+        if (playing_ && it != lists_.end()) {
+            ++it;
+        }
+        while (it != lists_.end() && it->priority >= priority) {
+            ++it;
+        }
+        lists_.insert(it, PromptList{
+            .sounds = std::move(sounds),
+            .priority = priority,
+            .on_complete = std::move(on_complete),
+        });
+    }
+
+    if (preempted) {
+        preempted(false);
+    }
+}
+
+void PromptSequencer::Clear() {
+    std::list<PromptList> lists;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (lists_.empty()) {
+            return;
+        }
+        lists = std::move(lists_);
+        lists_.clear();
+        playing_ = false;
+        generation_++;
+    }
+
+    for (auto& list : lists) {
+        if (list.on_complete) {
+            list.on_complete(false);
+        }
+    }
+}
+
+bool PromptSequencer::IsEmpty() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lists_.empty();
+}
+
+bool PromptSequencer::IsCurrent(uint32_t generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return generation == generation_;
+}
+
+bool PromptSequencer::NextPacket(std::vector<uint8_t>& opus, CompletionCallback& on_complete, uint32_t& generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation = generation_;
+    while (!lists_.empty()) {
+        auto& list = lists_.front();
+        playing_ = true;
+
+        // Skip to the next sound when the current one is exhausted, without resetting the decoder
+        while (list.sound_index < list.sounds.size() && list.offset + sizeof(BinaryProtocol3) > list.sounds[list.sound_index].size()) {
+            list.sound_index++;
+            list.offset = 0;
+        }
+        if (list.sound_index >= list.sounds.size()) {
+            // Play() never queues an empty list
+            lists_.pop_front();
+            playing_ = false;
+            continue;
+        }
+
+        auto& sound = list.sounds[list.sound_index];
+        auto p3 = (const BinaryProtocol3*)(sound.data() + list.offset);
+        auto payload_size = ntohs(p3->payload_size);
+        opus.assign(p3->payload, p3->payload + payload_size);
+        list.offset += sizeof(BinaryProtocol3) + payload_size;
+
+        // Was it the last packet of the last sound?
+        bool last = list.offset + sizeof(BinaryProtocol3) > sound.size();
+        for (size_t i = list.sound_index + 1; last && i < list.sounds.size(); i++) {
+            if (list.sounds[i].size() >= sizeof(BinaryProtocol3)) {
+                last = false;
+            }
+        }
+        if (last) {
+            on_complete = std::move(list.on_complete);
+            lists_.pop_front();
+            playing_ = false;
+        } else {
+            on_complete = nullptr;
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,58 @@
+#ifndef _PROMPT_SEQUENCER_H_
+#define _PROMPT_SEQUENCER_H_
+
+#include <opus_decoder.h>
+
+#include <string_view>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <functional>
+
+enum PromptPriority {
+    kPromptPriorityInfo,
+    kPromptPriorityWarning,
+    kPromptPriorityError
+};
+
+// 提示音播放队列：一组提示音连续播放，不重置解码器；高优先级打断正在播放的低优先级提示音
+class PromptSequencer {
+public:
+    // on_complete(true) 在最后一帧输出后调用，被打断或清除时调用 on_complete(false)
+    using CompletionCallback = std::function<void(bool completed)>;
+
+    PromptSequencer();
+    ~PromptSequencer();
+
+    // Prompts are p3 streams, 16000Hz 60ms Opus, decoded directly at the codec output rate
+    void Initialize(int output_sample_rate);
+    void Play(std::vector<std::string_view> sounds, PromptPriority priority = kPromptPriorityInfo,
+        CompletionCallback on_complete = nullptr);
+    void Clear();
+    bool IsEmpty();
+
+    // Called by the audio loop. on_complete is only set for the last packet of a prompt list.
+    // generation changes whenever a prompt is preempted or cleared
+    bool NextPacket(std::vector<uint8_t>& opus, CompletionCallback& on_complete, uint32_t& generation);
+    // Packets handed out under an older generation belong to a prompt that was cut off
+    bool IsCurrent(uint32_t generation);
+    inline OpusDecoderWrapper* decoder() const { return decoder_.get(); }
+
+private:
+    struct PromptList {
+        std::vector<std::string_view> sounds;
+        PromptPriority priority;
+        CompletionCallback on_complete;
+        size_t sound_index = 0;
+        size_t offset = 0;
+    };
+
+    std::mutex mutex_;
+    std::list<PromptList> lists_;
+    bool playing_ = false;
+    uint32_t generation_ = 0;
+    std::unique_ptr<OpusDecoderWrapper> decoder_;
+};
+
+#endif // _PROMPT_SEQUENCER_H_
@@ -0,0 +1,429 @@
+#include "json_message.h"
+
+#include <cstdio>
+#include <cstring>
+
+int JsonMessage::AllocToken(JsonTokenType type, size_t start, int parent) {
+    if (count_ >= kMaxTokens) {
+        return -1;
+    }
+    auto& token = tokens_[count_];
+    token.start = start;
+    token.end = start;
+    token.parent = parent;
+    token.type = type;
+    token.key = false;
+    return count_++;
+}
+
+// A value is complete, continue in the enclosing container (skipping the key it belongs to)
+int JsonMessage::CloseValue(int token) const {
+    int parent = tokens_[token].parent;
+    if (parent >= 0 && tokens_[parent].key) {
+        parent = tokens_[parent].parent;
+    }
+    return parent;
+}
+
+// What the grammar allows next, the "OrEnd" states also allow closing an empty container
+enum JsonParseState {
+    kJsonExpectValue,
+    kJsonExpectValueOrEnd,
+    kJsonExpectKey,
+    kJsonExpectKeyOrEnd,
+    kJsonExpectColon,
+    kJsonExpectCommaOrEnd,
+};
+
+static bool IsValidPrimitive(std::string_view text) {
+    if (text == "true" || text == "false" || text == "null") {
+        return true;
+    }
+    // A number, the value itself is only checked when it is read
+    size_t i = text[0] == '-' ? 1 : 0;
+    if (i >= text.size() || text[i] < '0' || text[i] > '9') {
+        return false;
+    }
+    for (; i < text.size(); i++) {
+        if (text[i] == '\0' || strchr("0123456789.eE+-", text[i]) == nullptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JsonMessage::Parse(const char* data, size_t length) {
+    data_ = data;
+    length_ = length;
+    count_ = 0;
+    if (data == nullptr || length > kMaxLength) {
+        return false;
+    }
+
+    int current = -1;
+    auto state = kJsonExpectValue;
+    for (size_t pos = 0; pos < length; pos++) {
+        char c = data[pos];
+        switch (c) {
+        case ' ': case '\t': case '\r': case '\n':
+            break;
+        case ':':
+            if (state != kJsonExpectColon) {
+                return false;
+            }
+            state = kJsonExpectValue;
+            break;
+        case ',':
+            if (state != kJsonExpectCommaOrEnd || current < 0) {
+                return false;
+            }
+            state = tokens_[current].type == kJsonTokenObject ? kJsonExpectKey : kJsonExpectValue;
+            break;
+        case '{':
+        case '[': {
+            // Only one root
+            if ((state != kJsonExpectValue && state != kJsonExpectValueOrEnd) || (count_ > 0 && current < 0)) {
+                return false;
+            }
+            int token = AllocToken(c == '{' ? kJsonTokenObject : kJsonTokenArray, pos, current);
+            if (token < 0) {
+                return false;
+            }
+            current = token;
+            state = c == '{' ? kJsonExpectKeyOrEnd : kJsonExpectValueOrEnd;
+            break;
+        }
+        case '}':
+        case ']': {
+            auto type = c == '}' ? kJsonTokenObject : kJsonTokenArray;
+            auto empty_state = c == '}' ? kJsonExpectKeyOrEnd : kJsonExpectValueOrEnd;
+            if (current < 0 || tokens_[current].type != type || (state != kJsonExpectCommaOrEnd && state != empty_state)) {
+                return false;
+            }
+            tokens_[current].end = pos + 1;
+            current = CloseValue(current);
+            state = kJsonExpectCommaOrEnd;
+            break;
+        }
+        case '"': {
+            bool key = state == kJsonExpectKey || state == kJsonExpectKeyOrEnd;
+            if (current < 0 || (!key && state != kJsonExpectValue && state != kJsonExpectValueOrEnd)) {
+                return false;
+            }
+            size_t start = pos + 1;
+            for (pos = start; pos < length && data[pos] != '"'; pos++) {
+                if (data[pos] == '\\') {
+                    pos++;
+                }
+            }
+            if (pos >= length) {
+                return false;
+            }
+            int token = AllocToken(kJsonTokenString, start, current);
+            if (token < 0) {
+                return false;
+            }
+            tokens_[token].end = pos;
+            if (key) {
+                tokens_[token].key = true;
+                current = token;
+                state = kJsonExpectColon;
+            } else {
+                current = CloseValue(token);
+                state = kJsonExpectCommaOrEnd;
+            }
+            break;
+        }
+        default: {
+            if (current < 0 || (state != kJsonExpectValue && state != kJsonExpectValueOrEnd)) {
+                return false;
+            }
+            size_t start = pos;
+            while (pos < length && strchr(",]} \t\r\n", data[pos]) == nullptr) {
+                pos++;
+            }
+            if (!IsValidPrimitive(std::string_view(data + start, pos - start))) {
+                return false;
+            }
+            int token = AllocToken(kJsonTokenPrimitive, start, current);
+            if (token < 0) {
+                return false;
+            }
+            tokens_[token].end = pos;
+            current = CloseValue(token);
+            state = kJsonExpectCommaOrEnd;
+            pos--;
+            break;
+        }
+        }
+    }
+
+    return current == -1 && state == kJsonExpectCommaOrEnd && tokens_[0].type == kJsonTokenObject;
+}
+
+int JsonMessage::Find(int object, std::string_view key) const {
+    if (!IsObject(object)) {
+        return -1;
+    }
+    for (int i = object + 1; i < count_ && tokens_[i].start < tokens_[object].end; i++) {
+        // Keys are compared as written, the protocol's keys never need escaping
+        if (tokens_[i].parent == object && tokens_[i].key &&
+            std::string_view(data_ + tokens_[i].start, tokens_[i].end - tokens_[i].start) == key) {
+            // The value is always the token right after its key
+            return i + 1 < count_ ? i + 1 : -1;
+        }
+    }
+    return -1;
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Four hex digits at p, -1 if there are not
+static int ParseHex4(const char* p, const char* end) {
+    if (end - p < 4) {
+        return -1;
+    }
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = HexValue(p[i]);
+        if (digit < 0) {
+            return -1;
+        }
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+static void AppendUtf8(std::string& text, uint32_t code_point) {
+    if (code_point < 0x80) {
+        text.push_back(code_point);
+    } else if (code_point < 0x800) {
+        text.push_back(0xC0 | (code_point >> 6));
+        text.push_back(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        text.push_back(0xE0 | (code_point >> 12));
+        text.push_back(0x80 | ((code_point >> 6) & 0x3F));
+        text.push_back(0x80 | (code_point & 0x3F));
+    } else {
+        text.push_back(0xF0 | (code_point >> 18));
+        text.push_back(0x80 | ((code_point >> 12) & 0x3F));
+        text.push_back(0x80 | ((code_point >> 6) & 0x3F));
+        text.push_back(0x80 | (code_point & 0x3F));
+    }
+}
+
+std::string JsonMessage::GetString(int token) const {
+    if (token < 0 || token >= count_ || tokens_[token].type != kJsonTokenString) {
+        return std::string();
+    }
+    const char* p = data_ + tokens_[token].start;
+    const char* end = data_ + tokens_[token].end;
+    const char* escape = (const char*)memchr(p, '\\', end - p);
+    if (escape == nullptr) {
+        return std::string(p, end);
+    }
+
+    std::string text(p, escape);
+    text.reserve(end - p);
+    for (p = escape; p < end; p++) {
+        if (*p != '\\') {
+            text.push_back(*p);
+            continue;
+        }
+        if (++p >= end) {
+            break;
+        }
+        switch (*p) {
+        case 'b': text.push_back('\b'); break;
+        case 'f': text.push_back('\f'); break;
+        case 'n': text.push_back('\n'); break;
+        case 'r': text.push_back('\r'); break;
+        case 't': text.push_back('\t'); break;
+        case 'u': {
+            int code_unit = ParseHex4(p + 1, end);
+            if (code_unit < 0) {
+                // Keep a broken escape as it is
+                text.append("\\u");
+                break;
+            }
+            p += 4;
+            uint32_t code_point = code_unit;
+            // A character outside the BMP comes as a surrogate pair
+            if (code_unit >= 0xD800 && code_unit < 0xDC00 && end - p > 6 && p[1] == '\\' && p[2] == 'u') {
+                int low = ParseHex4(p + 3, end);
+                if (low >= 0xDC00 && low < 0xE000) {
+                    code_point = 0x10000 + ((code_unit - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+            }
+            AppendUtf8(text, code_point);
+            break;
+        }
+        default:
+            // \" \\ and \/ stand for themselves
+            text.push_back(*p);
+            break;
+        }
+    }
+    return text;
+}
+
+int JsonMessage::GetInt(int token, int default_value) const {
+    if (token < 0 || token >= count_ || tokens_[token].type != kJsonTokenPrimitive) {
+        return default_value;
+    }
+    const char* p = data_ + tokens_[token].start;
+    const char* end = data_ + tokens_[token].end;
+    bool negative = *p == '-';
+    if (negative) {
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return default_value;
+    }
+    int value = 0;
+    // The fraction of a real number is truncated like cJSON's valueint
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        value = value * 10 + (*p - '0');
+    }
+    return negative ? -value : value;
+}
+
+bool JsonMessage::GetBool(int token, bool default_value) const {
+    if (token < 0 || token >= count_ || tokens_[token].type != kJsonTokenPrimitive) {
+        return default_value;
+    }
+    char c = data_[tokens_[token].start];
+    if (c == 't') {
+        return true;
+    } else if (c == 'f') {
+        return false;
+    }
+    return default_value;
+}
+
+std::string_view JsonMessage::GetRaw(int token) const {
+    if (token < 0 || token >= count_) {
+        return std::string_view();
+    }
+    size_t start = tokens_[token].start;
+    size_t end = tokens_[token].end;
+    if (tokens_[token].type == kJsonTokenString) {
+        start--;
+        end++;
+    }
+    return std::string_view(data_ + start, end - start);
+}
+
+JsonWriter::JsonWriter(char* buffer, size_t capacity) : buffer_(buffer), capacity_(capacity) {
+}
+
+void JsonWriter::Append(std::string_view text) {
+    if (overflow_ || length_ + text.size() > capacity_) {
+        overflow_ = true;
+        return;
+    }
+    memcpy(buffer_ + length_, text.data(), text.size());
+    length_ += text.size();
+}
+
+void JsonWriter::AppendChar(char c) {
+    if (overflow_ || length_ >= capacity_) {
+        overflow_ = true;
+        return;
+    }
+    buffer_[length_++] = c;
+}
+
+void JsonWriter::AppendEscaped(std::string_view text) {
+    static const char hex_chars[] = "0123456789abcdef";
+    for (char c : text) {
+        switch (c) {
+        case '"': Append("\\\""); break;
+        case '\\': Append("\\\\"); break;
+        case '\n': Append("\\n"); break;
+        case '\r': Append("\\r"); break;
+        case '\t': Append("\\t"); break;
+        default:
+            if ((uint8_t)c < 0x20) {
+                char escaped[] = { '\\', 'u', '0', '0', hex_chars[(c >> 4) & 0xF], hex_chars[c & 0xF] };
+                Append(std::string_view(escaped, sizeof(escaped)));
+            } else {
+                AppendChar(c);
+            }
+            break;
+        }
+    }
+}
+
+void JsonWriter::AppendKey(std::string_view key) {
+    if (need_comma_) {
+        AppendChar(',');
+    }
+    AppendChar('"');
+    AppendEscaped(key);
+    Append("\":");
+}
+
+JsonWriter& JsonWriter::BeginObject() {
+    if (need_comma_) {
+        AppendChar(',');
+    }
+    AppendChar('{');
+    need_comma_ = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginObject(std::string_view key) {
+    AppendKey(key);
+    AppendChar('{');
+    need_comma_ = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndObject() {
+    AppendChar('}');
+    need_comma_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(std::string_view key, std::string_view value) {
+    AppendKey(key);
+    AppendChar('"');
+    AppendEscaped(value);
+    AppendChar('"');
+    need_comma_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(std::string_view key, int value) {
+    char number[12];
+    int length = snprintf(number, sizeof(number), "%d", value);
+    AppendKey(key);
+    Append(std::string_view(number, length));
+    need_comma_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(std::string_view key, bool value) {
+    AppendKey(key);
+    Append(value ? "true" : "false");
+    need_comma_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::AddRaw(std::string_view key, std::string_view json) {
+    AppendKey(key);
+    Append(json);
+    need_comma_ = true;
+    return *this;
+}
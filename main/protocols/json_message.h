@@ -0,0 +1,117 @@
+#ifndef _JSON_MESSAGE_H_
+#define _JSON_MESSAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Control messages are small flat objects (hello, tts, stt, llm, goodbye, iot), a full cJSON
+// tree costs one heap allocation per node for each of them. JsonMessage tokenizes the frame
+// in place into a fixed token array, nothing is allocated while parsing and the input does not
+// need to be null-terminated. Strings are unescaped when they are read.
+enum JsonTokenType : uint8_t {
+    kJsonTokenUndefined,
+    kJsonTokenObject,
+    kJsonTokenArray,
+    kJsonTokenString,
+    kJsonTokenPrimitive, // number, true, false, null
+};
+
+struct JsonToken {
+    uint16_t start;
+    uint16_t end;
+    int16_t parent;
+    JsonTokenType type;
+    bool key;
+};
+
+class JsonMessage {
+public:
+    // An iot message with 8 commands of two parameters each takes about 100 tokens.
+    // JsonMessage lives on the stack of the network task, each token is 8 bytes
+    static constexpr int kMaxTokens = 128;
+    static constexpr size_t kMaxLength = UINT16_MAX;
+
+    // Returns false for malformed input, a non-object root or more than kMaxTokens tokens
+    bool Parse(const char* data, size_t length);
+
+    // Value token of key in object, -1 if missing
+    int Find(int object, std::string_view key) const;
+    int Find(std::string_view key) const { return Find(0, key); }
+
+    // String contents without the quotes and with the escape sequences decoded, \u escapes become UTF-8
+    std::string GetString(int token) const;
+    std::string GetString(int object, std::string_view key) const { return GetString(Find(object, key)); }
+    int GetInt(int token, int default_value = 0) const;
+    int GetInt(int object, std::string_view key, int default_value = 0) const { return GetInt(Find(object, key), default_value); }
+    bool GetBool(int token, bool default_value = false) const;
+    // The raw JSON text of any token, e.g. a nested object to pass on
+    std::string_view GetRaw(int token) const;
+
+    bool IsObject(int token) const { return token >= 0 && token < count_ && tokens_[token].type == kJsonTokenObject; }
+    std::string type() const { return GetString(Find("type")); }
+    std::string_view data() const { return std::string_view(data_, length_); }
+
+private:
+    const char* data_ = nullptr;
+    size_t length_ = 0;
+    int count_ = 0;
+    JsonToken tokens_[kMaxTokens];
+
+    int AllocToken(JsonTokenType type, size_t start, int parent);
+    int CloseValue(int current) const;
+};
+
+// FNV-1a, used to switch on message types. A hash match must still be confirmed by comparing
+// the string, the table is small but the server is free to send anything.
+constexpr uint32_t JsonHash(std::string_view text) {
+    uint32_t hash = 2166136261u;
+    for (char c : text) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return hash;
+}
+
+// Builds a JSON object into a caller provided buffer. Writes past the end are dropped and
+// flagged, check ok() before sending.
+class JsonWriter {
+public:
+    JsonWriter(char* buffer, size_t capacity);
+
+    JsonWriter& BeginObject();
+    JsonWriter& BeginObject(std::string_view key);
+    JsonWriter& EndObject();
+    JsonWriter& Add(std::string_view key, std::string_view value);
+    JsonWriter& Add(std::string_view key, const char* value) { return Add(key, std::string_view(value)); }
+    JsonWriter& Add(std::string_view key, int value);
+    JsonWriter& Add(std::string_view key, bool value);
+    // value must already be valid JSON
+    JsonWriter& AddRaw(std::string_view key, std::string_view json);
+
+    bool ok() const { return !overflow_; }
+    std::string_view str() const { return std::string_view(buffer_, length_); }
+
+private:
+    char* buffer_;
+    size_t capacity_;
+    size_t length_ = 0;
+    bool overflow_ = false;
+    bool need_comma_ = false;
+
+    void Append(std::string_view text);
+    void AppendChar(char c);
+    void AppendEscaped(std::string_view text);
+    void AppendKey(std::string_view key);
+};
+
+template <size_t N>
+class StaticJsonWriter : public JsonWriter {
+public:
+    StaticJsonWriter() : JsonWriter(storage_, N) {}
+
+private:
+    char storage_[N];
+};
+
+#endif // _JSON_MESSAGE_H_
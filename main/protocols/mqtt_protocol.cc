@@ -12,7 +12,10 @@
 
 #define TAG "MQTT"
 
-MqttProtocol::MqttProtocol() {
+// Leaves room for the rest of the hello in its 512 byte buffer
+#define MAX_RESUME_TOKEN_LENGTH 256
+
+MqttProtocol::MqttProtocol() : Protocol("mqtt_session") {
     event_group_handle_ = xEventGroupCreate();
 }
 
@@ -60,32 +63,31 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
+        JsonMessage message;
+        if (!message.Parse(payload.data(), payload.size())) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (type == nullptr) {
+        auto type = message.type();
+        if (type.empty()) {
             ESP_LOGE(TAG, "Message type is not specified");
-            cJSON_Delete(root);
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
-            ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+        if (type == "hello") {
+            ParseServerHello(message);
+        } else if (type == "goodbye") {
+            int session_id = message.Find("session_id");
+            auto id = message.GetString(session_id);
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %.*s", (int)id.size(), id.data());
+            if (session_id < 0 || session_id_ == id) {
                 Application::GetInstance().Schedule([this]() {
                     CloseAudioChannel();
                 });
             }
         } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+            on_incoming_json_(message);
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -100,19 +102,21 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     return true;
 }
 
-bool MqttProtocol::SendText(const std::string& text) {
+bool MqttProtocol::SendText(std::string_view text) {
     if (publish_topic_.empty()) {
         return false;
     }
-    if (!mqtt_->Publish(publish_topic_, text)) {
-        ESP_LOGE(TAG, "Failed to publish message: %s", text.c_str());
+    // The MQTT client takes the payload as std::string
+    if (!mqtt_->Publish(publish_topic_, std::string(text))) {
+        ESP_LOGE(TAG, "Failed to publish message: %.*s", (int)text.size(), text.data());
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
     }
     return true;
 }
 
-void MqttProtocol::SendAudio(const std::vector<uint8_t>& data) {
+void MqttProtocol::SendAudio(const AudioStreamPacket& packet) {
+    auto& data = packet.payload;
     std::lock_guard<std::mutex> lock(channel_mutex_);
     if (udp_ == nullptr) {
         return;
@@ -145,11 +149,13 @@ void MqttProtocol::CloseAudioChannel() {
         }
     }
 
-    std::string message = "{";
-    message += "\"session_id\":\"" + session_id_ + "\",";
-    message += "\"type\":\"goodbye\"";
-    message += "}";
-    SendText(message);
+    StaticJsonWriter<256> message;
+    message.BeginObject().Add("session_id", session_id_).Add("type", "goodbye").EndObject();
+    if (message.ok()) {
+        SendText(message.str());
+    } else {
+        ESP_LOGE(TAG, "Goodbye message too long");
+    }
 
     if (on_audio_channel_closed_ != nullptr) {
         on_audio_channel_closed_();
@@ -166,17 +172,39 @@ bool MqttProtocol::OpenAudioChannel() {
 
     error_occurred_ = false;
     session_id_ = "";
+    flow_control_supported_ = false;
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
+    // The UDP key and nonce are only valid for one open, so even with a resume token the audio waits
+    // for the server hello. The token still lets the server pick the session up again
+    SessionParams cached;
+    bool resume = session_cache_.Load(cached);
+    if (resume && cached.resume_token.size() > MAX_RESUME_TOKEN_LENGTH) {
+        ESP_LOGW(TAG, "Resume token too long, open without it");
+        session_cache_.Clear();
+        resume = false;
+    }
+
     // 发送 hello 消息申请 UDP 通道
-    std::string message = "{";
-    message += "\"type\":\"hello\",";
-    message += "\"version\": 3,";
-    message += "\"transport\":\"udp\",";
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
-    if (!SendText(message)) {
+    StaticJsonWriter<512> message;
+    message.BeginObject()
+        .Add("type", "hello")
+        .Add("version", 3)
+        .Add("transport", "udp")
+        .BeginObject("audio_params")
+            .Add("format", "opus")
+            .Add("sample_rate", 16000)
+            .Add("channels", 1)
+            .Add("frame_duration", OPUS_FRAME_DURATION_MS)
+        .EndObject();
+#if CONFIG_USE_TTS_FLOW_CONTROL
+    message.Add("flow_control", true);
+#endif
+    if (resume) {
+        message.Add("resume_token", cached.resume_token);
+    }
+    message.EndObject();
+    if (!message.ok() || !SendText(message.str())) {
         return false;
     }
 
@@ -188,7 +216,19 @@ bool MqttProtocol::OpenAudioChannel() {
         return false;
     }
 
-    std::lock_guard<std::mutex> lock(channel_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        ConnectUdp();
+    }
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+// Called with channel_mutex_ held
+void MqttProtocol::ConnectUdp() {
     if (udp_ != nullptr) {
         delete udp_;
     }
@@ -203,84 +243,96 @@ bool MqttProtocol::OpenAudioChannel() {
             return;
         }
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            audio_stream_stats_.received_packets++;
+            if (sequence < remote_sequence_) {
+                ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
+                audio_stream_stats_.late_packets++;
+                return;
+            }
+            if (sequence != remote_sequence_ + 1) {
+                ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+                if (sequence > remote_sequence_ + 1) {
+                    audio_stream_stats_.lost_packets += sequence - remote_sequence_ - 1;
+                }
+            }
         }
 
-        std::vector<uint8_t> decrypted;
+        // Decrypted into a buffer that is kept across packets, its capacity settles at the largest one
         size_t decrypted_size = data.size() - aes_nonce_.size();
         size_t nc_off = 0;
         uint8_t stream_block[16] = {0};
-        decrypted.resize(decrypted_size);
+        decrypt_buffer_.resize(decrypted_size);
         auto nonce = (uint8_t*)data.data();
         auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)decrypted.data());
+        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, decrypt_buffer_.data());
         if (ret != 0) {
             ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
             return;
         }
         if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(decrypted));
+            on_incoming_audio_(decrypt_buffer_.data(), decrypt_buffer_.size());
         }
         remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     udp_->Connect(udp_server_, udp_port_);
-
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
-    }
-    return true;
 }
 
-void MqttProtocol::ParseServerHello(const cJSON* root) {
-    auto transport = cJSON_GetObjectItem(root, "transport");
-    if (transport == nullptr || strcmp(transport->valuestring, "udp") != 0) {
-        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+
+void MqttProtocol::ParseServerHello(const JsonMessage& message) {
+    auto transport = message.GetString(0, "transport");
+    if (transport != "udp") {
+        ESP_LOGE(TAG, "Unsupported transport: %.*s", (int)transport.size(), transport.data());
         return;
     }
 
-    auto session_id = cJSON_GetObjectItem(root, "session_id");
-    if (session_id != nullptr) {
-        session_id_ = session_id->valuestring;
+    int session_id = message.Find("session_id");
+    if (session_id >= 0) {
+        session_id_ = message.GetString(session_id);
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
     // Get sample rate from hello message
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
-        }
-        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
-        if (frame_duration != NULL) {
-            server_frame_duration_ = frame_duration->valueint;
-        }
+    auto audio_params = message.Find("audio_params");
+    if (message.IsObject(audio_params)) {
+        server_sample_rate_ = message.GetInt(audio_params, "sample_rate", server_sample_rate_);
+        server_frame_duration_ = message.GetInt(audio_params, "frame_duration", server_frame_duration_);
     }
+    // Servers that do not know the flow message would only ignore it, it is not sent to them
+    flow_control_supported_ = message.GetBool(message.Find("flow_control"));
 
-    auto udp = cJSON_GetObjectItem(root, "udp");
-    if (udp == nullptr) {
+    auto udp = message.Find("udp");
+    if (!message.IsObject(udp)) {
         ESP_LOGE(TAG, "UDP is not specified");
         return;
     }
-    udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
-    udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
-    auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
-    auto nonce = cJSON_GetObjectItem(udp, "nonce")->valuestring;
-
-    // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
-    // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+    SessionParams params;
+    params.resume_token = message.GetString(0, "resume_token");
+    params.session_id = session_id_;
+    params.sample_rate = server_sample_rate_;
+    params.frame_duration = server_frame_duration_;
+
+    // A server that supports 0-RTT opens hands out a token for the next channel, no token means
+    // it did not accept the one presented or does not support resuming
+    if (params.resume_token.empty()) {
+        session_cache_.Clear();
+    } else {
+        session_cache_.Save(params);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        udp_server_ = message.GetString(udp, "server");
+        udp_port_ = message.GetInt(udp, "port");
+        aes_nonce_ = DecodeHexString(message.GetString(udp, "nonce"));
+        mbedtls_aes_init(&aes_ctx_);
+        mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(message.GetString(udp, "key")).c_str(), 128);
+        local_sequence_ = 0;
+        remote_sequence_ = 0;
+    }
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
@@ -293,10 +345,10 @@ static inline uint8_t CharToHex(char c) {
     return 0;  // 对于无效输入，返回0
 }
 
-std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
+std::string MqttProtocol::DecodeHexString(std::string_view hex_string) {
     std::string decoded;
     decoded.reserve(hex_string.size() / 2);
-    for (size_t i = 0; i < hex_string.size(); i += 2) {
+    for (size_t i = 0; i + 1 < hex_string.size(); i += 2) {
         char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
         decoded.push_back(byte);
     }
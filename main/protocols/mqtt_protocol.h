@@ -5,7 +5,6 @@
 #include "protocol.h"
 #include <mqtt.h>
 #include <udp.h>
-#include <cJSON.h>
 #include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
@@ -26,7 +25,7 @@ public:
     ~MqttProtocol();
 
     void Start() override;
-    void SendAudio(const std::vector<uint8_t>& data) override;
+    void SendAudio(const AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
@@ -44,6 +43,8 @@ private:
     Mqtt* mqtt_ = nullptr;
     Udp* udp_ = nullptr;
     mbedtls_aes_context aes_ctx_;
+    // Only used by the UDP receive callback
+    std::vector<uint8_t> decrypt_buffer_;
     std::string aes_nonce_;
     std::string udp_server_;
     int udp_port_;
@@ -51,10 +52,11 @@ private:
     uint32_t remote_sequence_;
 
     bool StartMqttClient(bool report_error=false);
-    void ParseServerHello(const cJSON* root);
-    std::string DecodeHexString(const std::string& hex_string);
+    void ParseServerHello(const JsonMessage& message);
+    void ConnectUdp();
+    std::string DecodeHexString(std::string_view hex_string);
 
-    bool SendText(const std::string& text) override;
+    bool SendText(std::string_view text) override;
 };
 
 
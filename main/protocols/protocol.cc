@@ -1,14 +1,56 @@
 #include "protocol.h"
+#include "application.h"
+#include "assets/lang_config.h"
 
+#include <cJSON.h>
 #include <esp_log.h>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+#define HELLO_TIMEOUT_MS 10000
+
+Protocol::Protocol(const std::string& session_namespace) : session_cache_(session_namespace) {
+    esp_timer_create_args_t hello_timer_args = {
+        .callback = [](void* arg) {
+            // The error handling changes the device state, leave it to the main loop
+            auto protocol = (Protocol*)arg;
+            Application::GetInstance().Schedule([protocol]() {
+                if (protocol->hello_pending_.exchange(false)) {
+                    ESP_LOGE(TAG, "No server hello for the resumed session, drop the cached parameters");
+                    protocol->session_cache_.Clear();
+                    protocol->SetError(Lang::Strings::SERVER_TIMEOUT);
+                }
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "hello_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&hello_timer_args, &hello_timer_);
+}
+
+Protocol::~Protocol() {
+    if (hello_timer_ != nullptr) {
+        esp_timer_stop(hello_timer_);
+        esp_timer_delete(hello_timer_);
+    }
+}
+
+void Protocol::StartHelloTimeout() {
+    esp_timer_stop(hello_timer_);
+    esp_timer_start_once(hello_timer_, HELLO_TIMEOUT_MS * 1000);
+}
+
+void Protocol::StopHelloTimeout() {
+    esp_timer_stop(hello_timer_);
+}
+
+void Protocol::OnIncomingJson(std::function<void(const JsonMessage& message)> callback) {
     on_incoming_json_ = callback;
 }
 
-void Protocol::OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback) {
+void Protocol::OnIncomingAudio(std::function<void(const uint8_t* data, size_t size)> callback) {
     on_incoming_audio_ = callback;
 }
 
@@ -24,6 +66,13 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
     on_network_error_ = callback;
 }
 
+AudioStreamStats Protocol::TakeAudioStreamStats() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    auto stats = audio_stream_stats_;
+    audio_stream_stats_ = AudioStreamStats();
+    return stats;
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -32,37 +81,79 @@ void Protocol::SetError(const std::string& message) {
 }
 
 void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
+    StaticJsonWriter<256> writer;
+    writer.BeginObject().Add("session_id", session_id_).Add("type", "abort");
     if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
+        writer.Add("reason", "wake_word_detected");
     }
-    message += "}";
-    SendText(message);
+    writer.EndObject();
+    if (!writer.ok()) {
+        ESP_LOGE(TAG, "Abort message too long");
+        return;
+    }
+    SendText(writer.str());
+}
+
+// Asks the server to hold back the TTS stream while the device's playback queue is nearly full.
+// Only sent to a server whose hello advertised it, for the others the device drops what does not fit
+void Protocol::SendFlowControl(bool pause) {
+    if (!flow_control_supported_) {
+        return;
+    }
+    StaticJsonWriter<256> writer;
+    writer.BeginObject()
+        .Add("session_id", session_id_)
+        .Add("type", "flow")
+        .Add("state", pause ? "pause" : "resume")
+        .EndObject();
+    if (!writer.ok()) {
+        ESP_LOGE(TAG, "Flow control message too long");
+        return;
+    }
+    SendText(writer.str());
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    StaticJsonWriter<256> writer;
+    writer.BeginObject()
+        .Add("session_id", session_id_)
+        .Add("type", "listen")
+        .Add("state", "detect")
+        .Add("text", wake_word)
+        .EndObject();
+    if (!writer.ok()) {
+        ESP_LOGE(TAG, "Wake word message too long");
+        return;
+    }
+    SendText(writer.str());
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    StaticJsonWriter<256> writer;
+    writer.BeginObject().Add("session_id", session_id_).Add("type", "listen").Add("state", "start");
     if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
+        writer.Add("mode", "realtime");
     } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
+        writer.Add("mode", "auto");
     } else {
-        message += ",\"mode\":\"manual\"";
+        writer.Add("mode", "manual");
     }
-    message += "}";
-    SendText(message);
+    writer.EndObject();
+    if (!writer.ok()) {
+        ESP_LOGE(TAG, "Start listening message too long");
+        return;
+    }
+    SendText(writer.str());
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    StaticJsonWriter<256> writer;
+    writer.BeginObject().Add("session_id", session_id_).Add("type", "listen").Add("state", "stop").EndObject();
+    if (!writer.ok()) {
+        ESP_LOGE(TAG, "Stop listening message too long");
+        return;
+    }
+    SendText(writer.str());
 }
 
 void Protocol::SendIotDescriptors(const std::string& descriptors) {
@@ -102,7 +193,7 @@ void Protocol::SendIotDescriptors(const std::string& descriptors) {
             continue;
         }
 
-        SendText(std::string(message));
+        SendText(message);
         cJSON_free(message);
         cJSON_Delete(messageRoot);
     }
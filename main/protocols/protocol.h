@@ -1,10 +1,18 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
-#include <cJSON.h>
+#include "json_message.h"
+#include "session_cache.h"
+
+#include <esp_timer.h>
+
 #include <string>
+#include <string_view>
+#include <vector>
 #include <functional>
 #include <chrono>
+#include <atomic>
+#include <mutex>
 
 struct BinaryProtocol3 {
     uint8_t type;
@@ -13,6 +21,40 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// Websocket audio frame of protocol version 2, all fields in network byte order.
+// Version 1 servers exchange bare Opus packets, the version is negotiated in hello
+struct BinaryProtocol2 {
+    uint16_t version;
+    uint8_t type;           // 0: opus
+    uint8_t flags;          // AudioFrameFlags
+    uint32_t sequence;      // per direction, starts from 1 for every audio channel
+    uint32_t timestamp;     // ms, capture time on the device for uplink, playout time of the answer for downlink
+    uint32_t payload_size;
+    uint8_t payload[];
+} __attribute__((packed));
+
+// An encoded uplink packet and the capture time of its first sample
+struct AudioStreamPacket {
+    std::vector<uint8_t> payload;
+    uint32_t timestamp = 0; // ms, esp_timer clock
+};
+
+enum AudioFrameFlags : uint8_t {
+    kAudioFrameFlagStreamStart = 0x01, // first frame of an utterance or an answer
+    kAudioFrameFlagStreamEnd = 0x02,   // last frame, may have no payload
+};
+
+// Receive side counters of the audio stream, only transports with sequence numbers fill them
+struct AudioStreamStats {
+    uint32_t received_packets = 0;
+    uint32_t lost_packets = 0;
+    uint32_t late_packets = 0;
+    uint32_t concealed_frames = 0;
+    // Transports with timestamps only: how much later than the earliest frame of the stream,
+    // relative to its playout time, the latest frame arrived. The buffer that would have hidden it
+    int max_delay_ms = 0;
+};
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -26,7 +68,8 @@ enum ListeningMode {
 
 class Protocol {
 public:
-    virtual ~Protocol() = default;
+    Protocol(const std::string& session_namespace);
+    virtual ~Protocol();
 
     inline int server_sample_rate() const {
         return server_sample_rate_;
@@ -37,9 +80,13 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // Counters since the last call
+    AudioStreamStats TakeAudioStreamStats();
 
-    void OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    // The packet points into the receive buffer of the transport and is only valid during the
+    // callback, like the JsonMessage of OnIncomingJson. Copy out what must be kept
+    void OnIncomingAudio(std::function<void(const uint8_t* data, size_t size)> callback);
+    void OnIncomingJson(std::function<void(const JsonMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
@@ -48,17 +95,21 @@ public:
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual void SendAudio(const std::vector<uint8_t>& data) = 0;
+    virtual void SendAudio(const AudioStreamPacket& packet) = 0;
+    // Hint that OpenAudioChannel is likely to follow soon, a transport that needs a connection
+    // per session may set it up ahead of time
+    virtual void Preconnect() {}
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
+    virtual void SendFlowControl(bool pause);
     virtual void SendIotDescriptors(const std::string& descriptors);
     virtual void SendIotStates(const std::string& states);
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
-    std::function<void(std::vector<uint8_t>&& data)> on_incoming_audio_;
+    std::function<void(const JsonMessage& message)> on_incoming_json_;
+    std::function<void(const uint8_t* data, size_t size)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
@@ -67,10 +118,22 @@ protected:
     int server_frame_duration_ = 60;
     bool error_occurred_ = false;
     std::string session_id_;
+    // Updated by the network task, taken by the main loop
+    std::mutex stats_mutex_;
+    AudioStreamStats audio_stream_stats_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    SessionCache session_cache_;
+    // Streaming on cached parameters, the server hello of this channel has not arrived yet
+    std::atomic<bool> hello_pending_{false};
+    // The server hello said it understands flow messages, like keep_warm it is only used once advertised
+    std::atomic<bool> flow_control_supported_{false};
+    esp_timer_handle_t hello_timer_ = nullptr;
 
-    virtual bool SendText(const std::string& text) = 0;
+    virtual bool SendText(std::string_view text) = 0;
     virtual void SetError(const std::string& message);
+    // The channel fails like a missed hello if the server does not answer a 0-RTT open in time
+    void StartHelloTimeout();
+    void StopHelloTimeout();
     virtual bool IsTimeout() const;
 };
 
@@ -0,0 +1,63 @@
+#include "session_cache.h"
+#include "settings.h"
+
+#include <esp_log.h>
+
+#define TAG "SessionCache"
+
+SessionCache::SessionCache(const std::string& ns) : ns_(ns) {
+}
+
+bool SessionCache::Load(SessionParams& params) {
+#if CONFIG_USE_ZERO_RTT_OPEN
+    Settings settings(ns_, false);
+    params.resume_token = settings.GetString("token");
+    if (params.resume_token.empty()) {
+        return false;
+    }
+    params.session_id = settings.GetString("session_id");
+    params.version = settings.GetInt("version", 1);
+    params.sample_rate = settings.GetInt("sample_rate", 24000);
+    params.frame_duration = settings.GetInt("frame_ms", 60);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SessionCache::Save(const SessionParams& params) {
+#if CONFIG_USE_ZERO_RTT_OPEN
+    SessionParams saved;
+    Load(saved);
+    Settings settings(ns_, true);
+    if (saved.resume_token != params.resume_token) {
+        settings.SetString("token", params.resume_token);
+    }
+    if (saved.session_id != params.session_id) {
+        settings.SetString("session_id", params.session_id);
+    }
+    if (!saved.SameAudioParams(params)) {
+        settings.SetInt("version", params.version);
+        settings.SetInt("sample_rate", params.sample_rate);
+        settings.SetInt("frame_ms", params.frame_duration);
+    }
+    // Written by earlier firmware, the UDP key must not outlive its session
+    if (!settings.GetString("udp_key").empty()) {
+        settings.EraseKey("udp_server");
+        settings.EraseKey("udp_port");
+        settings.EraseKey("udp_key");
+        settings.EraseKey("udp_nonce");
+    }
+#endif
+}
+
+void SessionCache::Clear() {
+#if CONFIG_USE_ZERO_RTT_OPEN
+    SessionParams saved;
+    if (Load(saved)) {
+        ESP_LOGI(TAG, "Drop cached session of %s", ns_.c_str());
+        Settings settings(ns_, true);
+        settings.EraseAll();
+    }
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef _SESSION_CACHE_H_
+#define _SESSION_CACHE_H_
+
+#include <string>
+
+// What the last server hello negotiated. Servers that support resuming hand out a resume_token,
+// the next OpenAudioChannel presents it and starts streaming on these parameters right away,
+// while the hello round trip completes in parallel (0-RTT open).
+// Only the non-secret audio parameters are kept. The UDP key and nonce of MQTT are fresh for every
+// open, reusing them with a restarted sequence number would repeat the AES-CTR keystream
+struct SessionParams {
+    std::string resume_token;
+    std::string session_id;
+    int version = 1;
+    int sample_rate = 24000;
+    int frame_duration = 60;
+
+    bool SameAudioParams(const SessionParams& other) const {
+        return version == other.version && sample_rate == other.sample_rate && frame_duration == other.frame_duration;
+    }
+};
+
+// Keeps SessionParams in NVS, one namespace per protocol. Nothing is loaded or stored
+// when CONFIG_USE_ZERO_RTT_OPEN is disabled
+class SessionCache {
+public:
+    SessionCache(const std::string& ns);
+
+    // False if there is no resume token to present
+    bool Load(SessionParams& params);
+    // Writes only what changed, the token may rotate on every hello
+    void Save(const SessionParams& params);
+    void Clear();
+
+private:
+    std::string ns_;
+};
+
+#endif // _SESSION_CACHE_H_
@@ -4,42 +4,288 @@
 #include "application.h"
 
 #include <cstring>
-#include <cJSON.h>
+#include <algorithm>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
 
 #define TAG "WS"
 
-WebsocketProtocol::WebsocketProtocol() {
+// A short gap is concealed by the decoder, a longer one is left as silence
+#define MAX_CONCEALED_FRAMES 3
+// Leaves room for the rest of the hello in its 512 byte buffer
+#define MAX_RESUME_TOKEN_LENGTH 256
+// Uplink held back while a lost connection is being resumed, about 15 s of 16 kbps Opus
+#define MAX_RESUME_BUFFER_BYTES (32 * 1024)
+#define RESUME_RETRY_INTERVAL_MS 500
+// How long the main loop waits for a resume task stuck in a connect, the task finishes on its own later
+#define RESUME_STOP_TIMEOUT_MS 1000
+
+WebsocketProtocol::WebsocketProtocol() : Protocol("ws_session") {
     event_group_handle_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT);
+
+    esp_timer_create_args_t standby_timer_args = {
+        .callback = [](void* arg) {
+            auto protocol = (WebsocketProtocol*)arg;
+            Application::GetInstance().Schedule([protocol]() {
+                if (protocol->standby_) {
+                    protocol->LeaveStandby(false);
+                    protocol->DestroyWebsocket();
+                }
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "standby_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&standby_timer_args, &standby_timer_);
+
+    esp_timer_create_args_t ping_timer_args = {
+        .callback = [](void* arg) {
+            auto protocol = (WebsocketProtocol*)arg;
+            Application::GetInstance().Schedule([protocol]() {
+                if (protocol->standby_ && protocol->websocket_ != nullptr) {
+                    protocol->websocket_->Ping();
+                    protocol->warm_pings_++;
+                }
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "ping_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&ping_timer_args, &ping_timer_);
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
-    if (websocket_ != nullptr) {
-        delete websocket_;
+    if (standby_timer_ != nullptr) {
+        esp_timer_stop(standby_timer_);
+        esp_timer_delete(standby_timer_);
+    }
+    if (ping_timer_ != nullptr) {
+        esp_timer_stop(ping_timer_);
+        esp_timer_delete(ping_timer_);
     }
+    StopResume(portMAX_DELAY);
+    DestroyWebsocket();
     vEventGroupDelete(event_group_handle_);
 }
 
 void WebsocketProtocol::Start() {
 }
 
-void WebsocketProtocol::SendAudio(const std::vector<uint8_t>& data) {
-    if (websocket_ == nullptr) {
+void WebsocketProtocol::SendAudio(const AudioStreamPacket& packet) {
+    if (websocket_ == nullptr && !resuming_) {
         return;
     }
 
-    websocket_->Send(data.data(), data.size(), true);
+    if (version_ < 2) {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        if (!standby_) {
+            SendFrameLocked(true, packet.payload.data(), packet.payload.size());
+        }
+    } else {
+        uint8_t flags = uplink_stream_start_.exchange(false) ? kAudioFrameFlagStreamStart : 0;
+        SendAudioFrame(packet.payload.data(), packet.payload.size(), flags, packet.timestamp);
+    }
+    // Control messages the main loop queued while this frame was being written
+    if (!FlushControlQueue()) {
+        Application::GetInstance().Schedule([this]() {
+            SetError(Lang::Strings::SERVER_ERROR);
+        });
+    }
+}
+
+void WebsocketProtocol::SendAudioFrame(const uint8_t* payload, size_t size, uint8_t flags, uint32_t timestamp) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    SendAudioFrameLocked(payload, size, flags, timestamp);
+}
+
+// The sequence is taken under send_mutex_, so frames go out in the order they are numbered
+bool WebsocketProtocol::SendAudioFrameLocked(const uint8_t* payload, size_t size, uint8_t flags, uint32_t timestamp) {
+    if (standby_) {
+        // The session has ended, the connection waits for the next one
+        return true;
+    }
+    send_buffer_.resize(sizeof(BinaryProtocol2) + size);
+    auto frame = (BinaryProtocol2*)send_buffer_.data();
+    frame->version = htons(2);
+    frame->type = 0;
+    frame->flags = flags;
+    frame->sequence = htonl(++local_sequence_);
+    frame->timestamp = htonl(timestamp);
+    frame->payload_size = htonl(size);
+    if (size > 0) {
+        memcpy(frame->payload, payload, size);
+    }
+    return SendFrameLocked(true, send_buffer_.data(), send_buffer_.size());
+}
+
+// The audio is sent from the uplink writer task, the control messages from the main loop. A send
+// can block for as long as TCP stalls, so the main loop never waits for send_mutex_: its messages
+// are queued and sent by whichever task holds the lock, right after the frame it is writing
+bool WebsocketProtocol::SendControl(ControlMessage message) {
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        control_queue_.push_back(std::move(message));
+    }
+    return FlushControlQueue();
+}
+
+// False if a message sent by this call failed
+bool WebsocketProtocol::FlushControlQueue() {
+    bool ok = true;
+    while (true) {
+        std::unique_lock<std::mutex> send_lock(send_mutex_, std::try_to_lock);
+        if (!send_lock.owns_lock()) {
+            // The holder checks the queue again after it lets go of the lock
+            return ok;
+        }
+        while (true) {
+            ControlMessage message;
+            {
+                std::lock_guard<std::mutex> lock(control_mutex_);
+                if (control_queue_.empty()) {
+                    break;
+                }
+                message = std::move(control_queue_.front());
+                control_queue_.pop_front();
+            }
+            if (message.stream_end) {
+                // The end has no audio of its own
+                if (!SendAudioFrameLocked(nullptr, 0, kAudioFrameFlagStreamEnd, message.timestamp)) {
+                    ESP_LOGE(TAG, "Failed to send the end of the audio stream");
+                    ok = false;
+                }
+            } else if (!SendFrameLocked(false, message.text.data(), message.text.size())) {
+                ESP_LOGE(TAG, "Failed to send text: %s", message.text.c_str());
+                ok = false;
+            }
+        }
+        send_lock.unlock();
+        // Queued by another task between the last check and the unlock
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        if (control_queue_.empty()) {
+            return ok;
+        }
+    }
+}
+
+// Messages queued for a session that is gone must not reach the next one
+void WebsocketProtocol::ClearControlQueue() {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    control_queue_.clear();
 }
 
-bool WebsocketProtocol::SendText(const std::string& text) {
+bool WebsocketProtocol::SendFrameLocked(bool binary, const void* data, size_t size) {
+    if (resuming_) {
+        // Held back until the session is resumed, if that takes long the oldest audio goes first
+        std::lock_guard<std::mutex> lock(resume_mutex_);
+        resume_buffer_.emplace_back(binary, std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + size));
+        resume_buffer_bytes_ += size;
+        for (auto it = resume_buffer_.begin(); resume_buffer_bytes_ > MAX_RESUME_BUFFER_BYTES && it != resume_buffer_.end(); ) {
+            if (it->first) {
+                resume_buffer_bytes_ -= it->second.size();
+                it = resume_buffer_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return true;
+    }
     if (websocket_ == nullptr) {
         return false;
     }
+    return websocket_->Send(data, size, binary);
+}
 
-    if (!websocket_->Send(text)) {
-        ESP_LOGE(TAG, "Failed to send text: %s", text.c_str());
+void WebsocketProtocol::ClearResumeBuffer() {
+    std::lock_guard<std::mutex> lock(resume_mutex_);
+    resume_buffer_.clear();
+    resume_buffer_bytes_ = 0;
+}
+
+void WebsocketProtocol::OnAudioFrame(const uint8_t* data, size_t size) {
+    if (size < sizeof(BinaryProtocol2)) {
+        ESP_LOGE(TAG, "Invalid audio frame size: %u", size);
+        return;
+    }
+    auto frame = (const BinaryProtocol2*)data;
+    uint32_t payload_size = ntohl(frame->payload_size);
+    if (ntohs(frame->version) != 2 || frame->type != 0 || payload_size > size - sizeof(BinaryProtocol2)) {
+        ESP_LOGE(TAG, "Invalid audio frame, version: %u, type: %u, payload size: %lu",
+            ntohs(frame->version), frame->type, payload_size);
+        return;
+    }
+
+    int conceal = 0;
+    std::unique_lock<std::mutex> stats_lock(stats_mutex_);
+    auto& stats = audio_stream_stats_;
+    stats.received_packets++;
+    uint32_t sequence = ntohl(frame->sequence);
+    bool stream_start = (frame->flags & kAudioFrameFlagStreamStart) != 0;
+    if (remote_sequence_ != 0 && !stream_start) {
+        int32_t gap = (int32_t)(sequence - remote_sequence_ - 1);
+        if (gap < 0) {
+            // Duplicate or reordered, its slot has already been played or concealed
+            stats.late_packets++;
+            return;
+        }
+        if (gap > 0) {
+            ESP_LOGW(TAG, "Lost %ld audio frames before sequence %lu", gap, sequence);
+            stats.lost_packets += gap;
+            conceal = std::min<int32_t>(gap, MAX_CONCEALED_FRAMES);
+            stats.concealed_frames += conceal;
+        }
+    }
+    remote_sequence_ = sequence;
+
+    // The clocks are not synchronized, so only the transit time relative to the fastest frame is meaningful
+    int64_t transit_ms = esp_timer_get_time() / 1000 - ntohl(frame->timestamp);
+    if (stream_start || transit_ms < min_transit_ms_) {
+        min_transit_ms_ = transit_ms;
+    }
+    stats.max_delay_ms = std::max<int>(stats.max_delay_ms, transit_ms - min_transit_ms_);
+    stats_lock.unlock();
+
+    for (int i = 0; i < conceal && on_incoming_audio_ != nullptr; i++) {
+        // An empty packet makes the decoder run its packet loss concealment
+        on_incoming_audio_(nullptr, 0);
+    }
+
+    if (payload_size > 0 && on_incoming_audio_ != nullptr) {
+        on_incoming_audio_(frame->payload, payload_size);
+    }
+}
+
+void WebsocketProtocol::SendStartListening(ListeningMode mode) {
+    uplink_stream_start_ = true;
+    Protocol::SendStartListening(mode);
+}
+
+void WebsocketProtocol::SendStopListening() {
+    // Version 2 servers see the end of the utterance in the audio stream itself
+    if (version_ >= 2 && (websocket_ != nullptr || resuming_)) {
+        // Stamped when the utterance is stopped, framed behind the audio the writer task is sending
+        ControlMessage message;
+        message.stream_end = true;
+        message.timestamp = (uint32_t)(esp_timer_get_time() / 1000);
+        SendControl(std::move(message));
+    }
+    Protocol::SendStopListening();
+}
+
+bool WebsocketProtocol::SendText(std::string_view text) {
+    if (websocket_ == nullptr && !resuming_) {
+        return false;
+    }
+
+    if (!SendControl({std::string(text)})) {
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
     }
@@ -48,81 +294,315 @@ bool WebsocketProtocol::SendText(const std::string& text) {
 }
 
 bool WebsocketProtocol::IsAudioChannelOpened() const {
+    // A channel being resumed still counts as open, the conversation goes on once it is back
+    if (resuming_) {
+        return true;
+    }
+    // A websocket in standby has no session
+    if (standby_) {
+        return false;
+    }
     return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel() {
-    if (websocket_ != nullptr) {
-        delete websocket_;
-        websocket_ = nullptr;
+    if (standby_) {
+        // No session to close, the standby timer decides when the connection goes
+        return;
+    }
+    hello_pending_ = false;
+    StopHelloTimeout();
+    if (!StopResume(pdMS_TO_TICKS(RESUME_STOP_TIMEOUT_MS))) {
+        // Cancelled, the resume task drops the websocket itself once its connect returns
+        ClearResumeBuffer();
+        ClearControlQueue();
+        return;
+    }
+    ClearResumeBuffer();
+    ClearControlQueue();
+
+#if CONFIG_USE_KEEP_WARM
+    if (!error_occurred_ && keep_warm_supported_ && websocket_ != nullptr && websocket_->IsConnected() && CanKeepWarm()) {
+        // End the session with a goodbye like MQTT does, the authenticated connection stays for the next one
+        StaticJsonWriter<128> message;
+        message.BeginObject().Add("session_id", session_id_).Add("type", "goodbye").EndObject();
+        bool sent = false;
+        if (message.ok()) {
+            // Standby is entered before the goodbye is queued, audio still queued in the uplink writer
+            // is dropped by SendAudio instead of reaching the server after the goodbye
+            standby_ = true;
+            sent = SendControl({std::string(message.str())});
+            if (!sent) {
+                standby_ = false;
+            }
+        } else {
+            ESP_LOGE(TAG, "Goodbye message too long");
+        }
+        if (sent) {
+            session_id_ = "";
+            warm_count_++;
+            EnterStandby(true, CONFIG_KEEP_WARM_IDLE_TIMEOUT_S * 1000);
+            if (on_audio_channel_closed_ != nullptr) {
+                on_audio_channel_closed_();
+            }
+            return;
+        }
     }
+#endif
+    DestroyWebsocket();
 }
 
-bool WebsocketProtocol::OpenAudioChannel() {
+#if CONFIG_USE_KEEP_WARM
+// An idle connection keeps the radio from its deepest power save, on a low battery it is not worth it
+bool WebsocketProtocol::CanKeepWarm() {
+    int level = 0;
+    bool charging = false, discharging = false;
+    if (Board::GetInstance().GetBatteryLevel(level, charging, discharging) && discharging
+        && level < CONFIG_KEEP_WARM_MIN_BATTERY_LEVEL) {
+        ESP_LOGI(TAG, "Battery at %d%%, do not keep the connection warm", level);
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Connected without a session, either ahead of a likely open or kept after a session
+void WebsocketProtocol::EnterStandby(bool warm, int timeout_ms) {
+    standby_ = true;
+    standby_warm_ = warm;
+    standby_since_ = esp_timer_get_time();
+    esp_timer_stop(standby_timer_);
+    esp_timer_start_once(standby_timer_, timeout_ms * 1000LL);
+#if CONFIG_USE_KEEP_WARM
+    if (warm) {
+        esp_timer_start_periodic(ping_timer_, CONFIG_KEEP_WARM_PING_INTERVAL_S * 1000000LL);
+    }
+#endif
+}
+
+void WebsocketProtocol::LeaveStandby(bool used) {
+    standby_ = false;
+    esp_timer_stop(standby_timer_);
+    esp_timer_stop(ping_timer_);
+    int64_t standby_ms = (esp_timer_get_time() - standby_since_) / 1000;
+    if (standby_warm_) {
+        // The time the connection was held for nothing is what keep-warm costs in battery
+        warm_time_total_ms_ += standby_ms;
+        if (used) {
+            warm_used_++;
+        }
+        ESP_LOGI(TAG, "Warm connection %s after %lld ms; %lu of %lu reused, %lld s held in total, %lu pings",
+            used ? "reused" : "closed", standby_ms, warm_used_, warm_count_, warm_time_total_ms_ / 1000, warm_pings_);
+    } else {
+        if (used) {
+            preconnect_used_++;
+        }
+        ESP_LOGI(TAG, "Preconnection %s after %lld ms; %lu of %lu used",
+            used ? "used" : "closed", standby_ms, preconnect_used_, preconnect_count_);
+    }
+}
+
+// Deleting the websocket fires its disconnect callback, which must not be taken for a lost connection
+void WebsocketProtocol::DestroyWebsocket() {
     if (websocket_ != nullptr) {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        closing_ = true;
         delete websocket_;
+        websocket_ = nullptr;
+        closing_ = false;
+    }
+    if (resuming_) {
+        // A resume reconnecting keeps what the main loop queued meanwhile, it goes to the resume buffer
+        FlushControlQueue();
     }
+}
 
-    error_occurred_ = false;
+bool WebsocketProtocol::Connect() {
     std::string url = CONFIG_WEBSOCKET_URL;
     std::string token = "Bearer " + std::string(CONFIG_WEBSOCKET_ACCESS_TOKEN);
-    websocket_ = Board::GetInstance().CreateWebSocket();
+    {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        websocket_ = Board::GetInstance().CreateWebSocket();
+    }
+    FlushControlQueue();
     websocket_->SetHeader("Authorization", token.c_str());
+    // 握手时按版本 1 声明，版本 2 只在 hello 中协商，不认识它的服务器仍然收到裸 Opus 帧
     websocket_->SetHeader("Protocol-Version", "1");
     websocket_->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
-            if (on_incoming_audio_ != nullptr) {
-                on_incoming_audio_(std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len));
+            if (version_ >= 2) {
+                OnAudioFrame((const uint8_t*)data, len);
+            } else if (on_incoming_audio_ != nullptr) {
+                on_incoming_audio_((const uint8_t*)data, len);
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (type != NULL) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
-                }
+            // Tokenize in place, the message only lives for the duration of this callback
+            JsonMessage message;
+            if (!message.Parse(data, len)) {
+                ESP_LOGE(TAG, "Failed to parse json message, data: %.*s", (int)len, data);
             } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
+                auto type = message.type();
+                if (type.empty()) {
+                    ESP_LOGE(TAG, "Missing message type, data: %.*s", (int)len, data);
+                } else if (type == "hello") {
+                    ParseServerHello(message);
+                } else if (on_incoming_json_ != nullptr) {
+                    on_incoming_json_(message);
+                }
             }
-            cJSON_Delete(root);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
-        ESP_LOGI(TAG, "Websocket disconnected");
-        if (on_audio_channel_closed_ != nullptr) {
-            on_audio_channel_closed_();
-        }
+        HandleDisconnected();
     });
 
     if (!websocket_->Connect(url.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server");
+        return false;
+    }
+    return true;
+}
+
+// Send hello message to describe the client
+// keys: message type, version, audio_params (format, sample_rate, channels), and what to resume if any
+bool WebsocketProtocol::SendHello(std::string_view resume_token, std::string_view session_id) {
+    StaticJsonWriter<512> message;
+    message.BeginObject()
+        .Add("type", "hello")
+        .Add("version", CONFIG_WEBSOCKET_PROTOCOL_VERSION)
+        .Add("transport", "websocket")
+        .BeginObject("audio_params")
+            .Add("format", "opus")
+            .Add("sample_rate", 16000)
+            .Add("channels", 1)
+            .Add("frame_duration", OPUS_FRAME_DURATION_MS)
+        .EndObject();
+#if CONFIG_USE_KEEP_WARM
+    message.Add("keep_warm", true);
+#endif
+#if CONFIG_USE_TTS_FLOW_CONTROL
+    message.Add("flow_control", true);
+#endif
+    if (!resume_token.empty()) {
+        message.Add("resume_token", resume_token);
+    }
+    if (!session_id.empty()) {
+        message.Add("session_id", session_id);
+    }
+    message.EndObject();
+    if (!message.ok()) {
+        ESP_LOGE(TAG, "Hello message too long");
+        return false;
+    }
+    bool sent;
+    if (session_id.empty()) {
+        // Opening on the main loop, which never waits for send_mutex_
+        sent = SendControl({std::string(message.str())});
+    } else {
+        // Resuming on its own task, the hello goes straight out ahead of the frames held back meanwhile
+        {
+            std::lock_guard<std::mutex> lock(send_mutex_);
+            sent = websocket_->Send(message.str().data(), message.str().size(), false);
+        }
+        FlushControlQueue();
+    }
+    if (!sent) {
+        ESP_LOGE(TAG, "Failed to send hello");
+    }
+    return sent;
+}
+
+// Runs on the main loop like OpenAudioChannel. Only the TCP/TLS connection and the websocket
+// upgrade are done, the hello is left for OpenAudioChannel so the server starts no session.
+void WebsocketProtocol::Preconnect() {
+#if CONFIG_USE_SPECULATIVE_PRECONNECT
+    if (websocket_ != nullptr || resuming_ || !IsResumeTaskDone()) {
+        // Already preconnected, a channel is open or a cancelled resume still holds the websocket
+        return;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    if (!Connect()) {
+        DestroyWebsocket();
+        return;
+    }
+    preconnect_count_++;
+    ESP_LOGI(TAG, "Preconnected in %lld ms", (esp_timer_get_time() - start_time) / 1000);
+    EnterStandby(false, CONFIG_PRECONNECT_IDLE_TIMEOUT_MS);
+#endif
+}
+
+bool WebsocketProtocol::OpenAudioChannel() {
+    int64_t start_time = esp_timer_get_time();
+    if (!StopResume(pdMS_TO_TICKS(RESUME_STOP_TIMEOUT_MS))) {
+        // The websocket is not ours until the cancelled resume has finished its connect
         SetError(Lang::Strings::SERVER_NOT_FOUND);
         return false;
     }
+    bool warm = false;
+    if (standby_) {
+        warm = websocket_ != nullptr && websocket_->IsConnected();
+        LeaveStandby(warm);
+    }
+    if (!warm) {
+        DestroyWebsocket();
+    }
 
-    // Send hello message to describe the client
-    // keys: message type, version, audio_params (format, sample_rate, channels)
-    std::string message = "{";
-    message += "\"type\":\"hello\",";
-    message += "\"version\": 1,";
-    message += "\"transport\":\"websocket\",";
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
-    if (!SendText(message)) {
+    error_occurred_ = false;
+    hello_pending_ = false;
+    StopHelloTimeout();
+    ClearResumeBuffer();
+    ClearControlQueue();
+    session_id_ = "";
+    // Bare Opus until the server hello confirms a newer version
+    version_ = 1;
+    keep_warm_supported_ = false;
+    flow_control_supported_ = false;
+    local_sequence_ = 0;
+    remote_sequence_ = 0;
+    min_transit_ms_ = INT64_MAX;
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+
+    if (!warm && !Connect()) {
+        SetError(Lang::Strings::SERVER_NOT_FOUND);
         return false;
     }
 
+    SessionParams cached;
+    bool zero_rtt = session_cache_.Load(cached);
+    if (zero_rtt && cached.resume_token.size() > MAX_RESUME_TOKEN_LENGTH) {
+        ESP_LOGW(TAG, "Resume token too long, open without it");
+        session_cache_.Clear();
+        zero_rtt = false;
+    }
+    if (zero_rtt) {
+        // Stream right away on the parameters of the last session, the server hello may still correct them
+        version_ = std::min(cached.version, CONFIG_WEBSOCKET_PROTOCOL_VERSION);
+        server_sample_rate_ = cached.sample_rate;
+        server_frame_duration_ = cached.frame_duration;
+        hello_pending_ = true;
+    }
+    if (!SendHello(zero_rtt ? cached.resume_token : "", "")) {
+        hello_pending_ = false;
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+
+    if (zero_rtt) {
+        ESP_LOGI(TAG, "0-RTT open, protocol version %d, %d Hz %d ms", version_.load(), server_sample_rate_, server_frame_duration_);
+        StartHelloTimeout();
+        RecordOpenTime(warm, start_time);
+        if (on_audio_channel_opened_ != nullptr) {
+            on_audio_channel_opened_();
+        }
+        return true;
+    }
+
     // Wait for server hello
     EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
@@ -131,6 +611,7 @@ bool WebsocketProtocol::OpenAudioChannel() {
         return false;
     }
 
+    RecordOpenTime(warm, start_time);
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
     }
@@ -138,24 +619,213 @@ bool WebsocketProtocol::OpenAudioChannel() {
     return true;
 }
 
-void WebsocketProtocol::ParseServerHello(const cJSON* root) {
-    auto transport = cJSON_GetObjectItem(root, "transport");
-    if (transport == nullptr || strcmp(transport->valuestring, "websocket") != 0) {
-        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+// Open latency on a reused connection against one set up from scratch
+void WebsocketProtocol::RecordOpenTime(bool warm, int64_t start_time) {
+    int64_t open_ms = (esp_timer_get_time() - start_time) / 1000;
+    open_count_[warm]++;
+    open_time_total_ms_[warm] += open_ms;
+    ESP_LOGI(TAG, "Audio channel opened %s in %lld ms; average warm %lld ms (%lu), cold %lld ms (%lu)",
+        warm ? "warm" : "cold", open_ms,
+        open_count_[1] ? open_time_total_ms_[1] / open_count_[1] : 0, open_count_[1],
+        open_count_[0] ? open_time_total_ms_[0] / open_count_[0] : 0, open_count_[0]);
+}
+
+// Called on the websocket task
+void WebsocketProtocol::HandleDisconnected() {
+    ESP_LOGI(TAG, "Websocket disconnected");
+    if (standby_) {
+        // No session on it, OpenAudioChannel will see it is gone and connect again
         return;
     }
+    if (resuming_) {
+        // An attempt of the running resume failed, it retries by itself
+        return;
+    }
+#if CONFIG_USE_SESSION_RESUME
+    // Only a server that names its sessions can resume one
+    if (!closing_ && !error_occurred_ && !session_id_.empty()) {
+        ESP_LOGW(TAG, "Connection lost, resume session %s", session_id_.c_str());
+        resuming_ = true;
+        // Reconnecting takes seconds, on a task of its own the main loop keeps running meanwhile
+        xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_CANCEL_EVENT | WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT);
+        if (xTaskCreate([](void* arg) {
+            auto protocol = (WebsocketProtocol*)arg;
+            protocol->ResumeSession();
+            xEventGroupSetBits(protocol->event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT);
+            vTaskDelete(NULL);
+        }, "ws_resume", 4096 * 2, this, 4, nullptr) == pdPASS) {
+            return;
+        }
+        ESP_LOGE(TAG, "Failed to create the resume task");
+        resuming_ = false;
+        ClearResumeBuffer();
+        xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT);
+    }
+#endif
+    if (on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+}
 
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
+#if CONFIG_USE_SESSION_RESUME
+// Runs on its own task. Whatever Application sends in the meantime lands in the resume buffer,
+// which is replayed ahead of anything sent later
+void WebsocketProtocol::ResumeSession() {
+    resume_attempts_++;
+    int64_t start_time = esp_timer_get_time();
+    int64_t deadline = start_time + CONFIG_SESSION_RESUME_WINDOW_MS * 1000LL;
+    std::string session_id = session_id_;
+    bool resumed = false;
+    while (resuming_ && esp_timer_get_time() < deadline) {
+        DestroyWebsocket();
+        xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+        if (Connect() && SendHello("", session_id)) {
+            int wait_ms = std::max<int64_t>(1, (deadline - esp_timer_get_time()) / 1000);
+            EventBits_t bits = xEventGroupWaitBits(event_group_handle_,
+                WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT | WEBSOCKET_PROTOCOL_RESUME_CANCEL_EVENT, pdFALSE, pdFALSE, pdMS_TO_TICKS(wait_ms));
+            if (bits & WEBSOCKET_PROTOCOL_RESUME_CANCEL_EVENT) {
+                break;
+            }
+            if (bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT) {
+                // Only a server that names the same session in its hello has picked it up again
+                if (hello_session_id_ != session_id) {
+                    ESP_LOGW(TAG, "Server answered with session \"%s\" instead of resuming", hello_session_id_.c_str());
+                    break;
+                }
+                resumed = true;
+                break;
+            }
         }
-        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
-        if (frame_duration != NULL) {
-            server_frame_duration_ = frame_duration->valueint;
+        xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_CANCEL_EVENT, pdFALSE, pdFALSE, pdMS_TO_TICKS(RESUME_RETRY_INTERVAL_MS));
+    }
+
+    int64_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    if (resumed) {
+        {
+            std::lock_guard<std::mutex> lock(send_mutex_);
+            // Unless the main loop closed the channel in the meantime
+            if (resuming_.exchange(false)) {
+                std::deque<std::pair<bool, std::vector<uint8_t>>> replay;
+                size_t replay_bytes;
+                {
+                    std::lock_guard<std::mutex> resume_lock(resume_mutex_);
+                    replay.swap(resume_buffer_);
+                    replay_bytes = resume_buffer_bytes_;
+                    resume_buffer_bytes_ = 0;
+                }
+                resume_successes_++;
+                resume_time_total_ms_ += elapsed_ms;
+                ESP_LOGI(TAG, "Session resumed in %lld ms, replay %u frames (%u bytes); %lu of %lu resumes succeeded, average %lld ms",
+                    elapsed_ms, replay.size(), replay_bytes, resume_successes_, resume_attempts_,
+                    resume_time_total_ms_ / resume_successes_);
+                for (auto& [binary, data] : replay) {
+                    websocket_->Send(data.data(), data.size(), binary);
+                }
+                last_incoming_time_ = std::chrono::steady_clock::now();
+            }
+        }
+        // What the main loop queued during the replay follows it
+        if (!FlushControlQueue()) {
+            Application::GetInstance().Schedule([this]() {
+                SetError(Lang::Strings::SERVER_ERROR);
+            });
         }
+        return;
     }
 
+    ESP_LOGW(TAG, "Session resume failed after %lld ms; %lu of %lu resumes succeeded", elapsed_ms, resume_successes_, resume_attempts_);
+    DestroyWebsocket();
+    bool was_resuming = resuming_.exchange(false);
+    // Dropped only once nothing can be added any more, the session they were meant for is gone
+    ClearResumeBuffer();
+    ClearControlQueue();
+    if (was_resuming) {
+        Application::GetInstance().Schedule([this]() {
+            // A channel opened again since then stays
+            if (!IsAudioChannelOpened() && on_audio_channel_closed_ != nullptr) {
+                on_audio_channel_closed_();
+            }
+        });
+    }
+}
+#endif
+
+// Runs on the main loop, ends a running resume and waits until its task has let go of the websocket.
+// A connect cannot be interrupted, if the task does not finish in time it is left to clean up
+// after itself and false is returned: the websocket must not be touched until it is done
+bool WebsocketProtocol::StopResume(TickType_t timeout) {
+    resuming_ = false;
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_CANCEL_EVENT);
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT, pdFALSE, pdFALSE, timeout);
+    if (!(bits & WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT)) {
+        ESP_LOGW(TAG, "Resume task still connecting, cancelled");
+        return false;
+    }
+    return true;
+}
+
+bool WebsocketProtocol::IsResumeTaskDone() {
+    return xEventGroupGetBits(event_group_handle_) & WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT;
+}
+
+void WebsocketProtocol::ParseServerHello(const JsonMessage& message) {
+    // What a 0-RTT open has been streaming on so far
+    SessionParams streaming;
+    streaming.version = version_;
+    streaming.sample_rate = server_sample_rate_;
+    streaming.frame_duration = server_frame_duration_;
+
+    auto transport = message.GetString(0, "transport");
+    if (transport != "websocket") {
+        ESP_LOGE(TAG, "Unsupported transport: %.*s", (int)transport.size(), transport.data());
+        return;
+    }
+
+    auto session_id = message.GetString(0, "session_id");
+    hello_session_id_ = session_id;
+    if (!session_id.empty()) {
+        session_id_ = session_id;
+        ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
+    }
+
+    auto audio_params = message.Find("audio_params");
+    if (message.IsObject(audio_params)) {
+        server_sample_rate_ = message.GetInt(audio_params, "sample_rate", server_sample_rate_);
+        server_frame_duration_ = message.GetInt(audio_params, "frame_duration", server_frame_duration_);
+    }
+
+    // Version 1 servers do not echo a version, both sides use the lower of the two
+    version_ = std::min(message.GetInt(0, "version", 1), CONFIG_WEBSOCKET_PROTOCOL_VERSION);
+    // Servers that do not know about keep-warm close their side on goodbye, the connection is not kept for them
+    keep_warm_supported_ = message.GetBool(message.Find("keep_warm"));
+    flow_control_supported_ = message.GetBool(message.Find("flow_control"));
+    ESP_LOGI(TAG, "Protocol version: %d, keep warm: %s, flow control: %s", version_.load(),
+        keep_warm_supported_ ? "yes" : "no", flow_control_supported_ ? "yes" : "no");
+
+    // A server that supports 0-RTT opens hands out a token for the next channel, no token means
+    // it did not accept the one presented or does not support resuming
+    SessionParams params;
+    params.resume_token = message.GetString(0, "resume_token");
+    params.version = version_;
+    params.sample_rate = server_sample_rate_;
+    params.frame_duration = server_frame_duration_;
+    if (params.resume_token.empty()) {
+        session_cache_.Clear();
+    } else {
+        session_cache_.Save(params);
+    }
+
+    if (hello_pending_.exchange(false)) {
+        StopHelloTimeout();
+        if (!params.SameAudioParams(streaming)) {
+            ESP_LOGW(TAG, "Server hello changed the cached audio parameters");
+            Application::GetInstance().Schedule([this]() {
+                if (on_audio_channel_opened_ != nullptr) {
+                    on_audio_channel_opened_();
+                }
+            });
+        }
+        return;
+    }
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
@@ -7,8 +7,17 @@
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <utility>
+#include <mutex>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define WEBSOCKET_PROTOCOL_RESUME_CANCEL_EVENT (1 << 1)
+// Set while no resume task is running
+#define WEBSOCKET_PROTOCOL_RESUME_DONE_EVENT (1 << 2)
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -16,17 +25,84 @@ public:
     ~WebsocketProtocol();
 
     void Start() override;
-    void SendAudio(const std::vector<uint8_t>& data) override;
+    void SendAudio(const AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    void Preconnect() override;
+    void SendStartListening(ListeningMode mode) override;
+    void SendStopListening() override;
 
 private:
     EventGroupHandle_t event_group_handle_;
     WebSocket* websocket_ = nullptr;
+    // Set on the main loop and the websocket task, read by the uplink writer task
+    std::atomic<int> version_{1};
+    std::vector<uint8_t> send_buffer_;
+    std::atomic<uint32_t> local_sequence_{0};
+    uint32_t remote_sequence_ = 0;
+    std::atomic<bool> uplink_stream_start_{false};
+    int64_t min_transit_ms_ = INT64_MAX;
+    // Text, or the end of the uplink stream which is framed when it is sent
+    struct ControlMessage {
+        std::string text;
+        bool stream_end = false;
+        uint32_t timestamp = 0;
+    };
 
-    void ParseServerHello(const cJSON* root);
-    bool SendText(const std::string& text) override;
+    // Guards websocket_ sends and send_buffer_ against the uplink writer task
+    std::mutex send_mutex_;
+    // Control messages waiting for send_mutex_, only held to queue or take one
+    std::mutex control_mutex_;
+    std::deque<ControlMessage> control_queue_;
+    std::atomic<bool> closing_{false};
+    std::atomic<bool> resuming_{false};
+    // Only held to add, take or drop frames, never across a send
+    std::mutex resume_mutex_;
+    std::deque<std::pair<bool, std::vector<uint8_t>>> resume_buffer_;  // binary flag, frame
+    size_t resume_buffer_bytes_ = 0;
+    // The session_id of the last server hello, empty if it had none
+    std::string hello_session_id_;
+    uint32_t resume_attempts_ = 0;
+    uint32_t resume_successes_ = 0;
+    int64_t resume_time_total_ms_ = 0;
+    esp_timer_handle_t standby_timer_ = nullptr;
+    esp_timer_handle_t ping_timer_ = nullptr;
+    std::atomic<bool> standby_{false};
+    // The server hello said a goodbye ends the session but may leave the connection open
+    std::atomic<bool> keep_warm_supported_{false};
+    bool standby_warm_ = false;
+    int64_t standby_since_ = 0;
+    uint32_t preconnect_count_ = 0;
+    uint32_t preconnect_used_ = 0;
+    uint32_t warm_count_ = 0;
+    uint32_t warm_used_ = 0;
+    uint32_t warm_pings_ = 0;
+    int64_t warm_time_total_ms_ = 0;
+    uint32_t open_count_[2] = {};  // cold, warm
+    int64_t open_time_total_ms_[2] = {};
+
+    bool Connect();
+    bool SendHello(std::string_view resume_token, std::string_view session_id);
+    void DestroyWebsocket();
+    bool CanKeepWarm();
+    void EnterStandby(bool warm, int timeout_ms);
+    void LeaveStandby(bool used);
+    void RecordOpenTime(bool warm, int64_t start_time);
+    void HandleDisconnected();
+    void ResumeSession();
+    bool StopResume(TickType_t timeout);
+    bool IsResumeTaskDone();
+    void ParseServerHello(const JsonMessage& message);
+    bool SendControl(ControlMessage message);
+    bool FlushControlQueue();
+    void ClearControlQueue();
+    bool SendFrameLocked(bool binary, const void* data, size_t size);
+    void ClearResumeBuffer();
+    void SendAudioFrame(const uint8_t* payload, size_t size, uint8_t flags, uint32_t timestamp);
+    bool SendAudioFrameLocked(const uint8_t* payload, size_t size, uint8_t flags, uint32_t timestamp);
+    void OnAudioFrame(const uint8_t* data, size_t size);
+    bool SendText(std::string_view text) override;
 };
 
 #endif
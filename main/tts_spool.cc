@@ -0,0 +1,176 @@
+#include "tts_spool.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "TtsSpool"
+
+TtsSpool::TtsSpool(size_t capacity, size_t max_packets, int pause_percent, int resume_percent)
+    : capacity_(capacity), max_packets_(max_packets), pause_percent_(pause_percent), resume_percent_(resume_percent) {
+    buffer_ = (uint8_t*)heap_caps_malloc(capacity_, MALLOC_CAP_SPIRAM);
+    if (buffer_ == nullptr) {
+        ESP_LOGW(TAG, "No PSRAM for the spool, using internal memory");
+        capacity_ = capacity_ / 8;
+        buffer_ = (uint8_t*)heap_caps_malloc(capacity_, MALLOC_CAP_8BIT);
+    }
+}
+
+TtsSpool::~TtsSpool() {
+    heap_caps_free(buffer_);
+}
+
+void TtsSpool::Write(const uint8_t* data, size_t size) {
+    size_t tail = (head_ + used_) % capacity_;
+    size_t first = std::min(size, capacity_ - tail);
+    memcpy(buffer_ + tail, data, first);
+    memcpy(buffer_, data + first, size - first);
+    used_ += size;
+}
+
+void TtsSpool::Read(uint8_t* data, size_t size) {
+    size_t first = std::min(size, capacity_ - head_);
+    memcpy(data, buffer_ + head_, first);
+    memcpy(data + first, buffer_, size - first);
+    head_ = (head_ + size) % capacity_;
+    used_ -= size;
+}
+
+// Called with the lock held after every change of the fill level
+TtsFlowTransition TtsSpool::CheckFlow() {
+    if (pause_percent_ < 0) {
+        return kTtsFlowNone;
+    }
+    int fill = FillPercent();
+    if (!paused_ && fill >= pause_percent_) {
+        paused_ = true;
+        return kTtsFlowPause;
+    }
+    if (paused_ && fill <= resume_percent_) {
+        paused_ = false;
+        return kTtsFlowResume;
+    }
+    return kTtsFlowNone;
+}
+
+bool TtsSpool::Push(const uint8_t* data, size_t size, TtsFlowTransition* flow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffer_ == nullptr || size > UINT16_MAX || used_ + sizeof(uint16_t) + size > capacity_ || packets_ >= max_packets_) {
+        dropped_packets_++;
+        dropped_bytes_ += size;
+        if (flow != nullptr) {
+            *flow = CheckFlow();
+        }
+        return false;
+    }
+    uint16_t length = size;
+    Write((const uint8_t*)&length, sizeof(length));
+    if (size > 0) {
+        Write(data, size);
+    }
+    packets_++;
+    if (used_ > high_water_) {
+        high_water_ = used_;
+    }
+    if (flow != nullptr) {
+        *flow = CheckFlow();
+    }
+    return true;
+}
+
+bool TtsSpool::Pop(std::vector<uint8_t>& packet, TtsFlowTransition* flow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (packets_ == 0) {
+        return false;
+    }
+    uint16_t size;
+    Read((uint8_t*)&size, sizeof(size));
+    packet.resize(size);
+    Read(packet.data(), size);
+    packets_--;
+    if (flow != nullptr) {
+        *flow = CheckFlow();
+    }
+    return true;
+}
+
+TtsFlowTransition TtsSpool::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (high_water_ > 0) {
+        ESP_LOGI(TAG, "High water mark: %u of %u bytes", high_water_, capacity_);
+    }
+    head_ = 0;
+    used_ = 0;
+    packets_ = 0;
+    high_water_ = 0;
+    complete_ = false;
+    bool was_paused = paused_;
+    paused_ = false;
+    return was_paused ? kTtsFlowResume : kTtsFlowNone;
+}
+
+bool TtsSpool::IsEmpty() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return packets_ == 0;
+}
+
+size_t TtsSpool::packets() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return packets_;
+}
+
+size_t TtsSpool::used_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_;
+}
+
+int TtsSpool::fill_percent() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return FillPercent();
+}
+
+int TtsSpool::FillPercent() const {
+    if (buffer_ == nullptr) {
+        return 100;
+    }
+    return std::max(used_ * 100 / capacity_, packets_ * 100 / max_packets_);
+}
+
+void TtsSpool::MarkStarted() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    complete_ = false;
+}
+
+void TtsSpool::MarkComplete() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    complete_ = true;
+}
+
+bool TtsSpool::IsComplete() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return complete_;
+}
+
+bool TtsSpool::TakeDrained() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (complete_ && packets_ == 0) {
+        complete_ = false;
+        return true;
+    }
+    return false;
+}
+
+uint32_t TtsSpool::TakeDroppedPackets() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t dropped = dropped_packets_;
+    dropped_packets_ = 0;
+    return dropped;
+}
+
+size_t TtsSpool::TakeDroppedBytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t dropped = dropped_bytes_;
+    dropped_bytes_ = 0;
+    return dropped;
+}
@@ -0,0 +1,75 @@
+#ifndef TTS_SPOOL_H
+#define TTS_SPOOL_H
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// What the server has to be told after a change of the spool
+enum TtsFlowTransition {
+    kTtsFlowNone,
+    kTtsFlowPause,
+    kTtsFlowResume
+};
+
+// Bounded byte ring in PSRAM holding the received TTS packets until they are played.
+// The server may send faster than realtime, the spool takes the burst so that the network
+// side can go idle long before the playback ends.
+class TtsSpool {
+public:
+    // Bounded by bytes and by packets, short packets would otherwise pile up in the length prefixes.
+    // With a pause threshold the spool also decides when the server should pause and resume, under
+    // the same lock as the change that crosses the threshold, so the two always alternate
+    TtsSpool(size_t capacity, size_t max_packets, int pause_percent = -1, int resume_percent = -1);
+    ~TtsSpool();
+
+    // Returns false and drops the packet if the spool is full
+    // Copies the packet straight from the receive buffer into the ring, an empty one asks the decoder
+    // to conceal a lost frame
+    bool Push(const uint8_t* data, size_t size, TtsFlowTransition* flow = nullptr);
+    bool Pop(std::vector<uint8_t>& packet, TtsFlowTransition* flow = nullptr);
+    // Drops the packets and the fully received mark. If the server was asked to pause for the dropped
+    // answer it is asked to resume, so a pause never outlives the answer it was sent for
+    TtsFlowTransition Clear();
+    bool IsEmpty();
+    size_t packets();
+    size_t used_bytes();
+    // The fuller of the byte and the packet bound, 0-100
+    int fill_percent();
+
+    // Cleared when the server starts an answer (tts start), the packets still queued play on
+    void MarkStarted();
+    // Set when the server has sent the last packet of the answer (tts stop)
+    void MarkComplete();
+    bool IsComplete();
+    // True once when the answer is fully received and everything is handed over for playback
+    bool TakeDrained();
+    // Packets refused because the spool was full. The new packet is the one dropped, so what is
+    // already queued plays on without a hole
+    uint32_t TakeDroppedPackets();
+    size_t TakeDroppedBytes();
+
+private:
+    std::mutex mutex_;
+    uint8_t* buffer_ = nullptr;
+    size_t capacity_;
+    size_t max_packets_;
+    size_t head_ = 0;
+    size_t used_ = 0;
+    size_t packets_ = 0;
+    size_t high_water_ = 0;
+    bool complete_ = false;
+    uint32_t dropped_packets_ = 0;
+    size_t dropped_bytes_ = 0;
+    int pause_percent_;
+    int resume_percent_;
+    bool paused_ = false;
+
+    int FillPercent() const;
+    TtsFlowTransition CheckFlow();
+    void Write(const uint8_t* data, size_t size);
+    void Read(uint8_t* data, size_t size);
+};
+
+#endif // TTS_SPOOL_H
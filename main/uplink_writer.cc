@@ -0,0 +1,87 @@
+#include "uplink_writer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "UplinkWriter"
+
+UplinkWriter::UplinkWriter(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+}
+
+UplinkWriter::~UplinkWriter() {
+    if (task_handle_ != nullptr) {
+        vTaskDelete(task_handle_);
+    }
+}
+
+void UplinkWriter::Start(std::function<void(const AudioStreamPacket& packet)> send) {
+    send_ = send;
+    // Above the main loop, a TLS write of one packet is short and the audio should not wait behind the UI
+    xTaskCreate([](void* arg) {
+        auto writer = (UplinkWriter*)arg;
+        writer->WriterLoop();
+        vTaskDelete(NULL);
+    }, "uplink_writer", 4096 * 2, this, 5, &task_handle_);
+}
+
+void UplinkWriter::OnSent(std::function<void(int64_t elapsed_us, size_t backlog)> callback) {
+    on_sent_ = callback;
+}
+
+bool UplinkWriter::Push(AudioStreamPacket&& packet) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+        dropped_packets_++;
+        return false;
+    }
+    slots_[head & mask_] = std::move(packet);
+    head_.store(head + 1, std::memory_order_release);
+    if (task_handle_ != nullptr) {
+        xTaskNotifyGive(task_handle_);
+    }
+    return true;
+}
+
+bool UplinkWriter::WaitForIdle(int timeout_ms) {
+    int64_t deadline = esp_timer_get_time() + timeout_ms * 1000LL;
+    while (backlog() > 0) {
+        if (esp_timer_get_time() >= deadline) {
+            ESP_LOGW(TAG, "%u packets still queued", backlog());
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    return true;
+}
+
+size_t UplinkWriter::backlog() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+}
+
+uint32_t UplinkWriter::TakeDroppedPackets() {
+    return dropped_packets_.exchange(0);
+}
+
+void UplinkWriter::WriterLoop() {
+    AudioStreamPacket packet;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        while (tail != head_.load(std::memory_order_acquire)) {
+            packet = std::move(slots_[tail & mask_]);
+            int64_t start_time = esp_timer_get_time();
+            send_(packet);
+            int64_t elapsed = esp_timer_get_time() - start_time;
+            tail_.store(++tail, std::memory_order_release);
+            if (on_sent_) {
+                on_sent_(elapsed, head_.load(std::memory_order_acquire) - tail);
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef UPLINK_WRITER_H
+#define UPLINK_WRITER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#include "protocol.h"
+
+// Network writer task for the uplink audio. The encoder pushes its packets into a single
+// producer / single consumer ring and this task writes them to the protocol, so the packets
+// neither go through the main loop queue nor hold up the state machine when the socket stalls.
+class UplinkWriter {
+public:
+    // capacity is rounded up to a power of two
+    UplinkWriter(size_t capacity);
+    ~UplinkWriter();
+
+    void Start(std::function<void(const AudioStreamPacket& packet)> send);
+    // Called on the writer task after each packet with the time the send took
+    void OnSent(std::function<void(int64_t elapsed_us, size_t backlog)> callback);
+
+    // Producer side, from one task only. Returns false and drops the packet if the queue is full
+    bool Push(AudioStreamPacket&& packet);
+    // Waits until everything pushed so far is written, so a control message sent next does not
+    // overtake the audio. False on timeout
+    bool WaitForIdle(int timeout_ms);
+    size_t backlog() const;
+    uint32_t TakeDroppedPackets();
+
+private:
+    std::vector<AudioStreamPacket> slots_;
+    size_t mask_;
+    std::atomic<size_t> head_{0};  // written by the producer
+    std::atomic<size_t> tail_{0};  // written by the writer task, after the send completes
+    std::atomic<uint32_t> dropped_packets_{0};
+    TaskHandle_t task_handle_ = nullptr;
+    std::function<void(const AudioStreamPacket& packet)> send_;
+    std::function<void(int64_t elapsed_us, size_t backlog)> on_sent_;
+
+    void WriterLoop();
+};
+
+#endif // UPLINK_WRITER_H
@@ -0,0 +1,118 @@
+#include "drift_compensator.h"
+#include "host_test.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define SAMPLE_RATE 16000
+#define PACKET_MS 60
+#define PACKET_SAMPLES (SAMPLE_RATE * PACKET_MS / 1000)
+#define TARGET_DEPTH_MS 300
+#define MAX_PPM 500
+
+struct StreamResult {
+    int drift_ppm;
+    int max_abs_drift_ppm;
+    int final_depth_ms;
+    int underruns;
+};
+
+// Plays one stream through a simulated device whose I2S clock runs skew_ppm faster than the server.
+// The server sends the first burst_packets at burst_speed times real time, then in real time, and
+// every packet arrives up to 30ms late. Returns the state after the given time
+static StreamResult RunStream(DriftCompensator& compensator, int skew_ppm, int burst_packets, int burst_speed, int seconds) {
+    uint32_t random = 12345;
+    auto next_random = [&random]() {
+        random = random * 1664525u + 1013904223u;
+        return random >> 8;
+    };
+
+    StreamResult result = {};
+    compensator.Reset();
+    int64_t send_time_us = 0;
+    int64_t next_arrival_us = 0;
+    int spool_packets = 0;
+    double dma_samples = 0;
+    double consumed_per_ms = SAMPLE_RATE / 1000.0 * (1 + skew_ppm / 1e6);
+    bool started = false;
+    int sent = 0;
+    std::vector<int16_t> pcm;
+
+    for (int64_t time_us = 0; time_us < seconds * 1000000LL; time_us += 1000) {
+        while (next_arrival_us <= time_us) {
+            spool_packets++;
+            sent++;
+            send_time_us += sent <= burst_packets ? PACKET_MS * 1000 / burst_speed : PACKET_MS * 1000;
+            next_arrival_us = send_time_us + next_random() % 30000;
+        }
+
+        if (started) {
+            dma_samples -= consumed_per_ms;
+            if (dma_samples < 0) {
+                dma_samples = 0;
+                result.underruns++;
+            }
+        }
+        // The audio loop keeps two packets ahead of the DMA, playback starts once the target depth is left after them
+        if (!started && (spool_packets - 2) * PACKET_MS < TARGET_DEPTH_MS) {
+            continue;
+        }
+        started = true;
+        while (dma_samples < 2 * PACKET_SAMPLES && spool_packets > 0) {
+            spool_packets--;
+            int depth_ms = (spool_packets + 1) * PACKET_MS;
+            compensator.Update(time_us, depth_ms);
+            // Quiet noise, so the compensator may adjust any frame
+            pcm.resize(PACKET_SAMPLES);
+            for (auto& sample : pcm) {
+                sample = (int16_t)(next_random() % 200) - 100;
+            }
+            compensator.Process(pcm, 1);
+            dma_samples += pcm.size();
+            result.final_depth_ms = depth_ms;
+        }
+        int drift = std::abs(compensator.drift_ppm());
+        if (drift > result.max_abs_drift_ppm) {
+            result.max_abs_drift_ppm = drift;
+        }
+    }
+    result.drift_ppm = compensator.drift_ppm();
+    return result;
+}
+
+static void TestSkew() {
+    const int skews_ppm[] = { 0, 150, -150, 300 };
+    for (int skew_ppm : skews_ppm) {
+        DriftCompensator compensator(TARGET_DEPTH_MS, MAX_PPM);
+        auto result = RunStream(compensator, skew_ppm, 0, 1, 1200);
+        printf("skew %d ppm: drift %d ppm, depth %d ms, %d underruns\n",
+            skew_ppm, result.drift_ppm, result.final_depth_ms, result.underruns);
+        // A faster I2S clock drains the buffer, which the compensator counters by slowing down
+        EXPECT(std::abs(result.drift_ppm + skew_ppm) <= 60, "skew %d ppm estimated as %d ppm", skew_ppm, -result.drift_ppm);
+        EXPECT(std::abs(result.final_depth_ms - TARGET_DEPTH_MS) <= 3 * PACKET_MS, "skew %d ppm ends at a depth of %d ms",
+            skew_ppm, result.final_depth_ms);
+    }
+}
+
+static void TestBurst() {
+    // A whole answer sent at twice real time fills the buffer far beyond the target
+    DriftCompensator compensator(TARGET_DEPTH_MS, MAX_PPM);
+    auto result = RunStream(compensator, 0, 400, 2, 120);
+    printf("burst: drift %d ppm, largest %d ppm, depth %d ms\n",
+        result.drift_ppm, result.max_abs_drift_ppm, result.final_depth_ms);
+    EXPECT(result.max_abs_drift_ppm <= 60, "a burst moved the drift estimate to %d ppm", result.max_abs_drift_ppm);
+
+    // The next stream starts from a clean estimate, before it measured any trend of its own
+    compensator.Reset();
+    compensator.Update(0, TARGET_DEPTH_MS);
+    compensator.Update(1000000, TARGET_DEPTH_MS);
+    printf("next stream: drift %d ppm\n", compensator.drift_ppm());
+    EXPECT(compensator.drift_ppm() == 0, "a new stream starts with a drift of %d ppm", compensator.drift_ppm());
+}
+
+int main() {
+    TestSkew();
+    TestBurst();
+    return HostTestResult();
+}
@@ -0,0 +1,27 @@
+#ifndef _HOST_TEST_H
+#define _HOST_TEST_H
+
+#include <cstdio>
+
+// Shared by the host tests: EXPECT records a failure and goes on, main ends with
+// return HostTestResult();
+inline int host_test_failures = 0;
+
+#define EXPECT(condition, format, ...) do { \
+    if (!(condition)) { \
+        printf("FAILED %s:%d: " format "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+        host_test_failures++; \
+    } \
+} while (0)
+
+// Prints the summary, the exit code fails the ctest run if any expectation failed
+inline int HostTestResult() {
+    if (host_test_failures > 0) {
+        printf("%d failures\n", host_test_failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
+
+#endif // _HOST_TEST_H
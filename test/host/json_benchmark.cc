@@ -0,0 +1,173 @@
+// Compares JsonMessage / StaticJsonWriter with the std::string and cJSON paths they replaced, on the
+// control message schemas. The heap is counted with a replaced operator new (and the cJSON hooks),
+// the run fails if tokenizing or writing allocates at all.
+//   ./json_benchmark [iterations]
+#include "json_message.h"
+#include "host_test.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#if HAVE_CJSON
+#include <cjson/cJSON.h>
+#endif
+
+static size_t allocated_bytes = 0;
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocated_bytes += size;
+    allocations++;
+    void* pointer = malloc(size > 0 ? size : 1);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    free(pointer);
+}
+
+#if HAVE_CJSON
+static void* CountingMalloc(size_t size) {
+    allocated_bytes += size;
+    allocations++;
+    return malloc(size);
+}
+#endif
+
+// Representative server messages, the same schemas Protocol and Application handle
+static const char* const kIncomingMessages[] = {
+    "{\"type\":\"hello\",\"transport\":\"websocket\",\"audio_params\":{\"format\":\"opus\",\"sample_rate\":24000,\"channels\":1,\"frame_duration\":60}}",
+    "{\"type\":\"hello\",\"transport\":\"udp\",\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\",\"audio_params\":{\"format\":\"opus\",\"sample_rate\":24000,\"channels\":1,\"frame_duration\":60},"
+        "\"udp\":{\"server\":\"120.24.160.13\",\"port\":8884,\"encryption\":\"aes-128-ctr\",\"key\":\"263094c3aa28cb42f3965a1020cb21a7\",\"nonce\":\"01000000ccba9720b4bc268100000000\"}}",
+    "{\"type\":\"tts\",\"state\":\"start\",\"sample_rate\":24000,\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\"}",
+    "{\"type\":\"tts\",\"state\":\"sentence_start\",\"text\":\"今天天气不错，适合出去走走。\",\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\"}",
+    "{\"type\":\"tts\",\"state\":\"stop\",\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\"}",
+    "{\"type\":\"stt\",\"text\":\"今天天气怎么样\",\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\"}",
+    "{\"type\":\"llm\",\"text\":\"😊\",\"emotion\":\"happy\",\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\"}",
+    "{\"type\":\"iot\",\"commands\":[{\"name\":\"Speaker\",\"method\":\"SetVolume\",\"parameters\":{\"volume\":60}}],\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\"}",
+    "{\"type\":\"goodbye\",\"session_id\":\"5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30\"}",
+};
+static const size_t kMessageCount = sizeof(kIncomingMessages) / sizeof(kIncomingMessages[0]);
+
+struct Result {
+    double us = 0;
+    size_t bytes = 0;
+    size_t allocations = 0;
+};
+
+// Runs body iterations times and measures it, the heap counters cover only the body
+template <typename Body>
+static Result Measure(int iterations, Body body) {
+    allocated_bytes = 0;
+    allocations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; n++) {
+        body();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    Result result;
+    result.us = std::chrono::duration<double, std::micro>(elapsed).count();
+    result.bytes = allocated_bytes;
+    result.allocations = allocations;
+    return result;
+}
+
+static void Print(const char* path, const Result& result, size_t messages) {
+    printf("| %s | %.0f | %.3f | %.1f | %.2f |\n", path, messages * 1000000.0 / result.us, result.us / messages,
+        (double)result.bytes / messages, (double)result.allocations / messages);
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t lengths[kMessageCount];
+    for (size_t i = 0; i < kMessageCount; i++) {
+        lengths[i] = strlen(kIncomingMessages[i]);
+    }
+    const std::string session_id = "5f2b1c7e-0a9d-4d3e-8c4b-2f6a1e9d7c30";
+    // Printed at the end so the compiler keeps the work
+    volatile size_t sink = 0;
+
+    printf("| path | msgs/s | us/msg | heap bytes/msg | allocs/msg |\n");
+    printf("|------|--------|--------|----------------|------------|\n");
+
+#if HAVE_CJSON
+    cJSON_Hooks hooks = { CountingMalloc, free };
+    cJSON_InitHooks(&hooks);
+    auto cjson_parse = Measure(iterations, [&]() {
+        for (size_t i = 0; i < kMessageCount; i++) {
+            cJSON* root = cJSON_Parse(kIncomingMessages[i]);
+            auto type = cJSON_GetObjectItem(root, "type");
+            if (strcmp(type->valuestring, "tts") == 0 || strcmp(type->valuestring, "stt") == 0) {
+                auto text = cJSON_GetObjectItem(root, "text");
+                sink = sink + (text != nullptr ? strlen(text->valuestring) : 0);
+            } else if (strcmp(type->valuestring, "hello") == 0) {
+                auto audio_params = cJSON_GetObjectItem(root, "audio_params");
+                sink = sink + cJSON_GetObjectItem(audio_params, "sample_rate")->valueint;
+            }
+            cJSON_Delete(root);
+        }
+    });
+    cJSON_InitHooks(nullptr);
+    Print("cJSON parse", cjson_parse, iterations * kMessageCount);
+#endif
+
+    // Tokenizing is what must not allocate, reading a string longer than the SSO buffer copies it
+    auto message_tokenize = Measure(iterations, [&]() {
+        for (size_t i = 0; i < kMessageCount; i++) {
+            JsonMessage message;
+            sink = sink + message.Parse(kIncomingMessages[i], lengths[i]);
+        }
+    });
+    Print("JsonMessage tokenize", message_tokenize, iterations * kMessageCount);
+    EXPECT(message_tokenize.allocations == 0, "JsonMessage tokenize allocated %zu times", message_tokenize.allocations);
+
+    auto message_parse = Measure(iterations, [&]() {
+        for (size_t i = 0; i < kMessageCount; i++) {
+            JsonMessage message;
+            message.Parse(kIncomingMessages[i], lengths[i]);
+            switch (JsonHash(message.type())) {
+            case JsonHash("tts"):
+            case JsonHash("stt"):
+                sink = sink + message.GetString(0, "text").size();
+                break;
+            case JsonHash("hello"):
+                sink = sink + message.GetInt(message.Find("audio_params"), "sample_rate");
+                break;
+            default:
+                break;
+            }
+        }
+    });
+    Print("JsonMessage parse", message_parse, iterations * kMessageCount);
+
+    // Outgoing: the previous std::string concatenation against the fixed buffer writer
+    auto string_write = Measure(iterations, [&]() {
+        std::string message = "{\"session_id\":\"" + session_id + "\"";
+        message += ",\"type\":\"listen\",\"state\":\"start\"";
+        message += ",\"mode\":\"auto\"";
+        message += "}";
+        sink = sink + message.size();
+    });
+    Print("std::string write", string_write, iterations);
+
+    auto writer_write = Measure(iterations, [&]() {
+        StaticJsonWriter<256> writer;
+        writer.BeginObject().Add("session_id", session_id).Add("type", "listen").Add("state", "start").Add("mode", "auto").EndObject();
+        sink = sink + writer.str().size();
+    });
+    Print("JsonWriter write", writer_write, iterations);
+    EXPECT(writer_write.allocations == 0, "JsonWriter write allocated %zu times", writer_write.allocations);
+
+    printf("sizeof(JsonMessage) = %zu bytes of stack, checksum %zu\n", sizeof(JsonMessage), (size_t)sink);
+    return HostTestResult();
+}
@@ -0,0 +1,95 @@
+#include "json_message.h"
+#include "host_test.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static bool Parse(JsonMessage& message, const char* text) {
+    return message.Parse(text, strlen(text));
+}
+
+static void TestStructure() {
+    const char* valid[] = {
+        "{}",
+        "{\"type\":\"tts\",\"state\":\"start\"}",
+        " { \"a\" : [ 1 , -2.5e3 , true , false , null ] , \"b\" : { } , \"c\" : [ ] } ",
+        "{\"a\":[{\"b\":[[]]}]}",
+    };
+    for (auto text : valid) {
+        JsonMessage message;
+        EXPECT(Parse(message, text), "rejected %s", text);
+    }
+
+    const char* invalid[] = {
+        "",
+        "[]",
+        "\"type\"",
+        "{\"type\" \"x\"}",
+        "{\"type\":\"t\",}",
+        "{,\"type\":\"t\"}",
+        "{\"type\"}",
+        "{\"type\":}",
+        "{\"type\"::\"t\"}",
+        "{\"a\":1 \"b\":2}",
+        "{\"a\":[1,]}",
+        "{\"a\":[,1]}",
+        "{\"a\":[1 2]}",
+        "{\"a\":tru}",
+        "{\"a\":x}",
+        "{\"a\":1}{}",
+        "{\"a\":1},",
+        "{\"a\":\"b}",
+        "{\"a\":[}",
+        "{1:2}",
+    };
+    for (auto text : invalid) {
+        JsonMessage message;
+        EXPECT(!Parse(message, text), "accepted %s", text);
+    }
+}
+
+static void TestLookup() {
+    JsonMessage message;
+    const char* text = "{\"type\":\"hello\",\"version\":3,\"udp\":{\"server\":\"1.2.3.4\",\"port\":8888},\"flag\":true}";
+    EXPECT(Parse(message, text), "rejected %s", text);
+    EXPECT(message.type() == "hello", "type is %s", message.type().c_str());
+    EXPECT(message.GetInt(0, "version") == 3, "version is %d", message.GetInt(0, "version"));
+    int udp = message.Find("udp");
+    EXPECT(message.IsObject(udp), "udp is not an object");
+    EXPECT(message.GetString(udp, "server") == "1.2.3.4", "server is %s", message.GetString(udp, "server").c_str());
+    EXPECT(message.GetInt(udp, "port") == 8888, "port is %d", message.GetInt(udp, "port"));
+    EXPECT(message.Find("port") < 0, "a nested key was found at the top level");
+    EXPECT(message.GetBool(message.Find("flag")), "flag is false");
+}
+
+static void TestUnescape() {
+    JsonMessage message;
+    const char* text = "{\"text\":\"a\\\"b\\\\c\\/d\\n\\u4f60\\u597d\\ud83d\\ude00\"}";
+    EXPECT(Parse(message, text), "rejected %s", text);
+    std::string expected = "a\"b\\c/d\n\xe4\xbd\xa0\xe5\xa5\xbd\xf0\x9f\x98\x80";
+    EXPECT(message.GetString(0, "text") == expected, "text is %s", message.GetString(0, "text").c_str());
+}
+
+static void TestManyTokens() {
+    // An iot message with 8 commands
+    std::string text = "{\"session_id\":\"abc\",\"type\":\"iot\",\"commands\":[";
+    for (int i = 0; i < 8; i++) {
+        if (i > 0) {
+            text += ",";
+        }
+        text += "{\"name\":\"Speaker\",\"method\":\"SetVolume\",\"parameters\":{\"volume\":" + std::to_string(i) + ",\"fade\":true}}";
+    }
+    text += "]}";
+    JsonMessage message;
+    EXPECT(message.Parse(text.data(), text.size()), "rejected an iot message with 8 commands");
+    EXPECT(message.type() == "iot", "type is %s", message.type().c_str());
+}
+
+int main() {
+    TestStructure();
+    TestLookup();
+    TestUnescape();
+    TestManyTokens();
+    return HostTestResult();
+}
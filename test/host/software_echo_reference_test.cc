@@ -0,0 +1,130 @@
+#include "software_echo_reference.h"
+#include "host_test.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <vector>
+
+int64_t host_test_time_us = 0;
+
+#define SAMPLE_RATE 16000
+#define BLOCK_SAMPLES 160
+#define BLOCK_US 10000
+#define MAX_LAG 320
+#define WINDOW 2048
+
+// White noise from a fixed seed, so every run sees the same signal
+class Noise {
+public:
+    explicit Noise(uint32_t seed) : state_(seed) {}
+
+    int16_t Next() {
+        state_ = state_ * 1664525u + 1013904223u;
+        return (int16_t)(((int32_t)(state_ >> 16) - 32768) / 4);
+    }
+
+private:
+    uint32_t state_;
+};
+
+static void TestEstimateDelay() {
+    Noise noise(1);
+    std::vector<int16_t> reference(WINDOW + 2 * MAX_LAG);
+    for (auto& sample : reference) {
+        sample = noise.Next();
+    }
+
+    const int lags[] = { -MAX_LAG, -100, -7, 0, 1, 50, MAX_LAG };
+    for (int lag : lags) {
+        // The echo of reference[MAX_LAG + i - lag] shows up in mic[i], at half the level and with some noise
+        std::vector<int16_t> mic(WINDOW);
+        for (int i = 0; i < WINDOW; i++) {
+            mic[i] = reference[MAX_LAG + i - lag] / 2 + noise.Next() / 8;
+        }
+        int estimate = SoftwareEchoReference::EstimateDelay(reference.data(), mic.data(), WINDOW, MAX_LAG);
+        EXPECT(estimate == lag, "lag %d estimated as %d", lag, estimate);
+    }
+
+    std::vector<int16_t> silence(WINDOW, 0);
+    EXPECT(SoftwareEchoReference::EstimateDelay(reference.data(), silence.data(), WINDOW, MAX_LAG) == INT32_MIN,
+        "silence must not give an estimate");
+
+    std::vector<int16_t> unrelated(WINDOW);
+    for (auto& sample : unrelated) {
+        sample = noise.Next();
+    }
+    EXPECT(SoftwareEchoReference::EstimateDelay(reference.data(), unrelated.data(), WINDOW, MAX_LAG) == INT32_MIN,
+        "uncorrelated signals must not give an estimate");
+}
+
+// Plays noise through a simulated DMA whose real latency differs from the configured one, and
+// returns the lag still left between the echo and the reference after the given time
+static int RunAlignment(int64_t true_latency_us, int64_t configured_latency_us, int seconds, int64_t* final_latency_us) {
+    SoftwareEchoReference echo(SAMPLE_RATE, 1, SAMPLE_RATE, configured_latency_us);
+    Noise noise(2);
+
+    int64_t latency_samples = true_latency_us * SAMPLE_RATE / 1000000;
+    int64_t start_index = SAMPLE_RATE;
+    int steps = seconds * 1000000 / BLOCK_US;
+    // What reaches the microphone, indexed by the time it is heard
+    std::vector<int16_t> heard(start_index + (int64_t)steps * BLOCK_SAMPLES + latency_samples + BLOCK_SAMPLES, 0);
+    std::vector<int16_t> mic_history;
+    std::vector<int16_t> reference_history;
+
+    host_test_time_us = start_index * 1000000 / SAMPLE_RATE;
+    for (int step = 0; step < steps; step++) {
+        int64_t now_index = host_test_time_us * SAMPLE_RATE / 1000000;
+
+        // The block written now ends at the head of the TX queue and is heard after the latency
+        std::vector<int16_t> block(BLOCK_SAMPLES);
+        for (int i = 0; i < BLOCK_SAMPLES; i++) {
+            block[i] = noise.Next();
+            heard[now_index - BLOCK_SAMPLES + i + latency_samples] = block[i];
+        }
+        echo.OnOutput(block.data(), block.size());
+
+        // The block captured now ends now
+        std::vector<int16_t> mic(BLOCK_SAMPLES);
+        std::vector<int16_t> reference(BLOCK_SAMPLES);
+        for (int i = 0; i < BLOCK_SAMPLES; i++) {
+            mic[i] = heard[now_index - BLOCK_SAMPLES + i] / 2;
+        }
+        echo.Fill(mic.data(), reference.data(), mic.size());
+        mic_history.insert(mic_history.end(), mic.begin(), mic.end());
+        reference_history.insert(reference_history.end(), reference.begin(), reference.end());
+
+        host_test_time_us += BLOCK_US;
+    }
+
+    // The last window, with the reference margins the search needs around it
+    size_t end = mic_history.size() - MAX_LAG;
+    const int16_t* reference = reference_history.data() + end - WINDOW - MAX_LAG;
+    const int16_t* mic = mic_history.data() + end - WINDOW;
+    int lag = SoftwareEchoReference::EstimateDelay(reference, mic, WINDOW, MAX_LAG);
+    printf("true latency %lld us, configured %lld us: residual lag %d samples, latency now %lld us\n",
+        (long long)true_latency_us, (long long)configured_latency_us, lag, (long long)echo.latency_us());
+    *final_latency_us = echo.latency_us();
+    return lag;
+}
+
+static void TestAlignment() {
+    // Within the resync threshold, beyond it, and an echo earlier than configured
+    const int64_t offsets_us[] = { 0, 2000, 10000, -6000 };
+    for (int64_t offset_us : offsets_us) {
+        int64_t true_latency_us = 75000;
+        int64_t final_latency_us = 0;
+        int lag = RunAlignment(true_latency_us, true_latency_us - offset_us, 20, &final_latency_us);
+        EXPECT(lag != INT32_MIN && std::abs(lag) <= 1, "offset %lld us leaves a lag of %d samples",
+            (long long)offset_us, lag);
+        // One sample is 62.5us
+        EXPECT(std::abs(final_latency_us - true_latency_us) <= 63, "offset %lld us ends at a latency of %lld us",
+            (long long)offset_us, (long long)final_latency_us);
+    }
+}
+
+int main() {
+    TestEstimateDelay();
+    TestAlignment();
+    return HostTestResult();
+}
@@ -0,0 +1,17 @@
+#ifndef _HOST_TEST_ESP_HEAP_CAPS_H
+#define _HOST_TEST_ESP_HEAP_CAPS_H
+
+#include <cstdlib>
+
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_8BIT (1 << 2)
+
+inline void* heap_caps_malloc(size_t size, int caps) {
+    return malloc(size);
+}
+
+inline void heap_caps_free(void* ptr) {
+    free(ptr);
+}
+
+#endif // _HOST_TEST_ESP_HEAP_CAPS_H
@@ -0,0 +1,13 @@
+#ifndef _HOST_TEST_ESP_TIMER_H
+#define _HOST_TEST_ESP_TIMER_H
+
+#include <cstdint>
+
+// The tests drive the clock themselves
+extern int64_t host_test_time_us;
+
+inline int64_t esp_timer_get_time() {
+    return host_test_time_us;
+}
+
+#endif // _HOST_TEST_ESP_TIMER_H
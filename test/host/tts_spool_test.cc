@@ -0,0 +1,101 @@
+#include "tts_spool.h"
+#include "host_test.h"
+
+#include <cstdio>
+#include <atomic>
+#include <thread>
+
+static void TestThresholds() {
+    // 10 packets at most, pause from 8, resume at 2
+    TtsSpool spool(4096, 10, 80, 20);
+    uint8_t data[100] = {};
+    std::vector<uint8_t> packet;
+    for (int i = 1; i <= 10; i++) {
+        TtsFlowTransition flow = kTtsFlowNone;
+        spool.Push(data, sizeof(data), &flow);
+        EXPECT(flow == (i == 8 ? kTtsFlowPause : kTtsFlowNone), "push %d gave %d", i, flow);
+    }
+    for (int i = 9; i >= 0; i--) {
+        TtsFlowTransition flow = kTtsFlowNone;
+        spool.Pop(packet, &flow);
+        EXPECT(flow == (i == 2 ? kTtsFlowResume : kTtsFlowNone), "pop down to %d gave %d", i, flow);
+    }
+
+    // Clearing resumes only a paused server, with flow control off it never asks anything
+    EXPECT(spool.Clear() == kTtsFlowNone, "clear resumed a server that was not paused");
+    for (int i = 1; i <= 8; i++) {
+        TtsFlowTransition flow = kTtsFlowNone;
+        spool.Push(data, sizeof(data), &flow);
+    }
+    EXPECT(spool.Clear() == kTtsFlowResume, "clear did not resume a paused server");
+    EXPECT(spool.Clear() == kTtsFlowNone, "a second clear resumed again");
+    TtsSpool plain(4096, 10);
+    TtsFlowTransition flow = kTtsFlowNone;
+    for (int i = 0; i < 10; i++) {
+        plain.Push(data, sizeof(data), &flow);
+        EXPECT(flow == kTtsFlowNone, "a spool without thresholds gave %d", flow);
+    }
+    EXPECT(plain.Clear() == kTtsFlowNone, "a spool without thresholds resumed on clear");
+}
+
+static void TestCompleteMark() {
+    TtsSpool spool(4096, 10);
+    uint8_t data[100] = {};
+    std::vector<uint8_t> packet;
+    spool.Push(data, sizeof(data));
+    spool.MarkComplete();
+    // The next answer starts before the previous one has played out
+    spool.MarkStarted();
+    spool.Push(data, sizeof(data));
+    while (spool.Pop(packet)) {
+    }
+    EXPECT(!spool.TakeDrained(), "the new answer was taken as drained before its stop");
+    spool.MarkComplete();
+    EXPECT(spool.TakeDrained(), "the answer did not drain after its stop");
+    EXPECT(!spool.TakeDrained(), "drained twice");
+}
+
+static void TestConcurrent() {
+    // A producer and a consumer racing around the thresholds, every pause must be followed by one resume
+    TtsSpool spool(1 << 16, 64, 75, 25);
+    uint8_t data[16] = {};
+    std::atomic<int> pauses{0};
+    std::atomic<int> resumes{0};
+    auto record = [&](TtsFlowTransition flow) {
+        if (flow == kTtsFlowPause) {
+            pauses++;
+        } else if (flow == kTtsFlowResume) {
+            resumes++;
+        }
+    };
+
+    std::thread producer([&]() {
+        for (int i = 0; i < 200000; i++) {
+            TtsFlowTransition flow = kTtsFlowNone;
+            spool.Push(data, sizeof(data), &flow);
+            record(flow);
+        }
+    });
+    std::thread consumer([&]() {
+        std::vector<uint8_t> packet;
+        for (int i = 0; i < 200000; i++) {
+            TtsFlowTransition flow = kTtsFlowNone;
+            spool.Pop(packet, &flow);
+            record(flow);
+        }
+    });
+    producer.join();
+    consumer.join();
+    printf("concurrent: %d pauses, %d resumes\n", pauses.load(), resumes.load());
+    EXPECT(pauses - resumes == 0 || pauses - resumes == 1, "%d pauses against %d resumes", pauses.load(), resumes.load());
+    // Clearing settles a pause left over, and only that one
+    record(spool.Clear());
+    EXPECT(pauses == resumes, "%d pauses against %d resumes after clear", pauses.load(), resumes.load());
+}
+
+int main() {
+    TestThresholds();
+    TestCompleteMark();
+    TestConcurrent();
+    return HostTestResult();
+}